@@ -1,3 +1,13 @@
 COMPONENT_DEPENDS := DiskStorage SPI
 COMPONENT_INCDIRS := src/include
 COMPONENT_DOXYGEN_INPUT := src/include
+
+# Set to 0 to remove instrumentation code
+CONFIG_VARS += SD_ENABLE_METRICS
+SD_ENABLE_METRICS ?= 1
+GLOBAL_CFLAGS += -DSD_ENABLE_METRICS=$(SD_ENABLE_METRICS)
+
+# Set to 0 to support only block-addressed (SDHC/SDXC) cards
+CONFIG_VARS += SD_ENABLE_BYTE_ADDRESSING
+SD_ENABLE_BYTE_ADDRESSING ?= 1
+GLOBAL_CFLAGS += -DSD_ENABLE_BYTE_ADDRESSING=$(SD_ENABLE_BYTE_ADDRESSING)
@@ -32,6 +32,37 @@ uint64_t CSD::getSize() const
 	}
 }
 
+namespace
+{
+// TRAN_SPEED and TAAC time values. As for linux, these are scaled by 10 to keep them integral.
+const uint8_t timeValues[]{0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+} // namespace
+
+uint32_t CSD::getTransferRate() const
+{
+	static const uint32_t units[]{10000, 100000, 1000000, 10000000};
+
+	auto speed = tran_speed();
+	unsigned unit = speed & 0x07;
+	if(unit >= ARRAY_SIZE(units)) {
+		return 0;
+	}
+	return units[unit] * timeValues[(speed >> 3) & 0x0f];
+}
+
+uint32_t CSD::getAccessTime(uint32_t clock) const
+{
+	static const uint32_t units[]{1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+
+	auto access = taac();
+	uint32_t ns = units[access & 0x07] * timeValues[(access >> 3) & 0x0f] / 10;
+	if(clock != 0) {
+		// NSAC is in units of 100 clock cycles
+		ns += uint64_t(nsac()) * 100 * 1000000000U / clock;
+	}
+	return ns;
+}
+
 size_t CSD::printTo(Print& p) const
 {
 	size_t n{0};
@@ -46,6 +77,8 @@ size_t CSD::printTo(Print& p) const
 
 	auto& csd = *this;
 	SDCARD_CSD_MAP_A(XX)
+	FIELD("transfer rate", getTransferRate())
+	FIELD("access time (ns)", getAccessTime(0))
 
 	switch(structure()) {
 	case Structure::v1: {
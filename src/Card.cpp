@@ -37,11 +37,13 @@ Descr: Low-level SDCard functions
 #include <Storage/Disk.h>
 #include <Clock.h>
 #include <debug_progmem.h>
+#include <algorithm>
 
 /* MMC/SD command (SPI mode) */
 enum Command : uint8_t {
 	CMD0 = 0,			// GO_IDLE_STATE
 	CMD1 = 1,			// SEND_OP_COND
+	CMD6 = 6,			// SWITCH_FUNC
 	ACMD41 = 0x80 | 41, // SEND_OP_COND (SDC)
 	CMD8 = 8,			// SEND_IF_COND
 	CMD9 = 9,			// SEND_CSD
@@ -59,6 +61,7 @@ enum Command : uint8_t {
 	CMD32 = 32,			// ERASE_ER_BLK_START
 	CMD33 = 33,			// ERASE_ER_BLK_END
 	CMD38 = 38,			// ERASE
+	ACMD51 = 0x80 | 51, // SEND_SCR (SDC)
 	CMD55 = 55,			// APP_CMD
 	CMD58 = 58,			// READ_OCR
 };
@@ -84,31 +87,155 @@ enum Token {
 		return false;                                                                                                  \
 	}
 
+namespace
+{
+/*
+ * Most operations complete quickly so poll continuously at first, then back off
+ * progressively. This avoids oversleeping on fast cards without hogging the CPU on slow ones.
+ */
+class PollTimer
+{
+public:
+	PollTimer(uint32_t timeout) : startTime(micros()), timeout(timeout)
+	{
+	}
+
+	/*
+	 * Delay before next poll, returns false on timeout
+	 */
+	bool next()
+	{
+		auto elapsed = getElapsed();
+		if(elapsed >= timeout) {
+			return false;
+		}
+		if(elapsed >= continuousPollTime) {
+			delayMicroseconds(interval);
+			interval = std::min(interval * 2, maxInterval);
+		}
+		return true;
+	}
+
+	uint32_t getElapsed() const
+	{
+		return micros() - startTime;
+	}
+
+private:
+	static constexpr uint32_t continuousPollTime{100};
+	static constexpr uint32_t minInterval{8};
+	static constexpr uint32_t maxInterval{1024};
+
+	uint32_t startTime;
+	uint32_t timeout;
+	uint32_t interval{minInterval};
+};
+
+} // namespace
+
 namespace Storage::SD
 {
+#if SD_ENABLE_BYTE_ADDRESSING
+inline bool Card::isBlockAddressed() const
+{
+	return (cardType & CT_BLOCK) != 0;
+}
+#endif
+
 /*
  * Wait for card ready
  */
-bool Card::wait_ready() /* 1:OK, 0:Timeout */
+bool Card::wait_ready(uint32_t timeout)
 {
-	for(unsigned tmr = 5000; tmr; tmr--) { /* Wait for ready in timeout of 500ms */
-		uint8_t d = spi.transfer(0xff);
-		if(d == 0xFF) {
+	PollTimer timer(timeout);
+	bool res;
+	do {
+		res = poll(PollFor::ready, readyBurstSize);
+	} while(!res && timer.next());
+	// Trailing bytes are just more 0xFF
+	pollBuffer.clear();
+
+	SD_METRICS(metrics.waitReadyUs += timer.getElapsed();)
+	return res;
+}
+
+/*
+ * Wait for any programming operation in progress to complete
+ */
+bool Card::wait_busy()
+{
+	if(!busy) {
+		return true;
+	}
+	if(!wait_ready(busyTimeout)) {
+		return false;
+	}
+	busy = false;
+	return true;
+}
+
+/*
+ * Deselect the card and release SPI bus
+ */
+void Card::deselect()
+{
+	digitalWrite(chipSelect, HIGH);
+	if(bus.isOwner(*this)) {
+		spi.transfer(0xff); /* Send 0xFF Dummy clock (force DO hi-z for multiple slave SPI) */
+		bus.release(*this);
+	}
+	pollBuffer.clear();
+	selected = false;
+}
+
+/*
+ * Scan received bytes for one satisfying the condition, clocking a further burst from the card if necessary.
+ * The matching byte and any which follow are retained for `receive()`.
+ */
+bool Card::poll(PollFor what, uint8_t burstSize)
+{
+	auto match = [what](uint8_t d) -> bool {
+		switch(what) {
+		case PollFor::ready:
+			return d == 0xFF;
+		case PollFor::token:
+			return d != 0xFF;
+		case PollFor::response:
+			return (d & 0x80) == 0;
+		default:
+			return false;
+		}
+	};
+
+	auto& buf = pollBuffer;
+	for(; buf.pos < buf.len; ++buf.pos) {
+		if(match(buf.data[buf.pos])) {
 			return true;
 		}
-		delayMicroseconds(100);
 	}
 
+	buf.clear();
+	receive(buf.data, burstSize);
+	for(unsigned i = 0; i < burstSize; ++i) {
+		if(match(buf.data[i])) {
+			buf.pos = i;
+			buf.len = burstSize;
+			return true;
+		}
+	}
 	return false;
 }
 
 /*
- * Deselect the card and release SPI bus
+ * Get next byte from card, using any retained by `poll()` first
  */
-void Card::deselect()
+uint8_t Card::receive_byte()
 {
-	digitalWrite(chipSelect, HIGH);
-	spi.transfer(0xff); /* Send 0xFF Dummy clock (force DO hi-z for multiple slave SPI) */
+	auto& buf = pollBuffer;
+	if(buf.pos < buf.len) {
+		return buf.data[buf.pos++];
+	}
+	return spi.transfer(0xff);
 }
 
 /**
@@ -118,9 +245,14 @@ void Card::deselect()
  */
 bool Card::select()
 {
+	if(!bus.acquire(*this, spiSettings)) {
+		debug_e("[SD] SPI bus busy");
+		return false;
+	}
 	digitalWrite(chipSelect, LOW);
 	spi.transfer(0xff); /* Dummy clock (force DO enabled) */
-	if(wait_ready()) {
+	if(wait_busy()) {
+		selected = true;
 		return true;
 	}
 
@@ -134,22 +266,22 @@ bool Card::select()
  */
 bool Card::rcvr_datablock(void* buff, size_t btr)
 {
-	/* Wait for data packet in timeout of 100ms */
-	uint8_t d{0xFF};
-	for(unsigned tmr = 1000; tmr; tmr--) {
-		d = spi.transfer(0xff);
-		if(d != 0xFF) {
-			break;
+	/* Wait for data packet */
+	PollTimer timer(readTimeout);
+	while(!poll(PollFor::token, sizeof(pollBuffer.data))) {
+		if(!timer.next()) {
+			SD_METRICS(++metrics.tokenTimeouts;)
+			return false;
 		}
-		delayMicroseconds(100);
 	}
-	if(d != 0xFE) {
+	if(receive_byte() != 0xFE) {
 		return false; /* If not valid data token, return with error */
 	}
 
-	memset(buff, 0xFF, btr);
-	spi.transfer(static_cast<uint8_t*>(buff), btr);
-	spi.transfer16(0xffff); // keep MOSI HIGH, discard CRC
+	receive(buff, btr);
+	uint8_t crc[2];
+	receive(crc, sizeof(crc)); // keep MOSI HIGH, discard CRC
+	SD_METRICS(metrics.bytesRead += btr;)
 
 	// success
 	return true;
@@ -160,33 +292,91 @@ bool Card::rcvr_datablock(void* buff, size_t btr)
  */
 bool Card::xmit_datablock(const void* buff, uint8_t token)
 {
-	if(!wait_ready()) {
+	if(!wait_busy()) {
 		debug_e("[SD] wait_ready failed");
 		return false;
 	}
 
+	// Anything received so far precedes the data response
+	pollBuffer.clear();
+
 	// Send the token
 	spi.transfer(token);
 	if(token == TK_STOP_TRAN) {
+		busy = true;
+		busyTimeout = writeTimeout;
 		return true;
 	}
 
-	// Data gets modified so take a copy
-	uint8_t buffer[sectorSize];
-	memcpy(buffer, buff, sizeof(buffer));
-	spi.transfer(buffer, sizeof(buffer)); // Data
-	spi.transfer16(0xffff);				  // Dummy CRC
-	uint8_t d = spi.transfer(0xff);		  // Keep MOSI HIGH, read response
+	send(buff, sectorSize);			// Data
+	spi.transfer16(0xffff);			// Dummy CRC
+	uint8_t d = spi.transfer(0xff); // Keep MOSI HIGH, read response
+
+	// Card is busy programming whether or not data was accepted
+	busy = true;
+	busyTimeout = writeTimeout;
 
 	// If not accepted, return with error
 	if((d & 0x1F) != 0x05) {
 		debug_e("[SDCard] data not accepted, d = 0x%02x", d);
+		SD_METRICS(++metrics.dataRejects;)
 		return false;
 	}
 
+	SD_METRICS(metrics.bytesWritten += sectorSize;)
+
+	statusPending = true;
 	return true;
 }
 
+/*
+ * Send data without modifying source buffer
+ */
+void Card::send(const void* data, size_t size)
+{
+	if(spiExt != nullptr) {
+		spiExt->send(data, size);
+		return;
+	}
+
+	// Full-duplex transfer overwrites data, so copy in chunks to limit stack usage
+	uint8_t buffer[64];
+	auto src = static_cast<const uint8_t*>(data);
+	while(size != 0) {
+		auto n = std::min(size, sizeof(buffer));
+		memcpy(buffer, src, n);
+		spi.transfer(buffer, n);
+		src += n;
+		size -= n;
+	}
+}
+
+/*
+ * Receive data with MOSI held high
+ */
+void Card::receive(void* data, size_t size)
+{
+	// Start with anything already received whilst polling
+	auto& buf = pollBuffer;
+	auto bufptr = static_cast<uint8_t*>(data);
+	auto n = std::min(size, size_t(buf.len - buf.pos));
+	memcpy(bufptr, &buf.data[buf.pos], n);
+	buf.pos += n;
+	bufptr += n;
+	size -= n;
+	if(size == 0) {
+		return;
+	}
+
+	if(spiExt != nullptr) {
+		spiExt->receive(bufptr, size);
+		return;
+	}
+
+	memset(bufptr, 0xFF, size);
+	spi.transfer(bufptr, size);
+}
+
 /*
  * Send a command packet to the card
  *
@@ -194,6 +384,8 @@ bool Card::xmit_datablock(const void* buff, uint8_t token)
  */
 uint8_t Card::send_cmd(uint8_t cmd, uint32_t arg)
 {
+	bool batched = (batchDepth != 0);
+
 	if(cmd & 0x80) { /* ACMD<n> is the command sequence of CMD55-CMD<n> */
 		cmd &= 0x7F;
 		uint8_t n = send_cmd(CMD55, 0);
@@ -201,10 +393,27 @@ uint8_t Card::send_cmd(uint8_t cmd, uint32_t arg)
 			debug_e("[SD] CMD55 error, n = 0x%02x", n);
 			return n;
 		}
+		batched = true;
 	}
 
+	SD_METRICS(auto startTime = micros();)
+
+	// Discard any output from previous command
+	pollBuffer.clear();
+
 	/* Select the card and wait for ready except to stop multiple block read */
-	if(cmd != CMD12) {
+	if(cmd == CMD12) {
+		// Card already selected
+	} else if(batched && selected) {
+		// Continuing a command sequence so card is already selected, just need the gap between commands
+		SD_METRICS(++metrics.batchedCommands;)
+		spi.transfer(0xff);
+		if(!wait_busy()) {
+			debug_e("[SD] Busy timeout");
+			deselect();
+			return 0xFF;
+		}
+	} else {
 		deselect();
 		if(!select()) {
 			debug_e("[SD] Select failed");
@@ -238,17 +447,262 @@ uint8_t Card::send_cmd(uint8_t cmd, uint32_t arg)
 		spi.transfer(0xff);
 	}
 
-	/* Wait for a valid response */
-	uint8_t d;
-	unsigned n = 10;
-	do {
-		d = spi.transfer(0xff);
-	} while((d & 0x80) && --n);
+	/* Wait for a valid response, within 8 bytes for SD cards */
+	uint8_t d = poll(PollFor::response, responseBurstSize) ? receive_byte() : 0xFF;
 
-	debug_d("[SD] send_cmd(%u): 0x%02x (%u try)", cmd, d, n);
+	// R1b response: card signals busy until operation completes
+	if(cmd == CMD12 || cmd == CMD38) {
+		busy = true;
+		busyTimeout = writeTimeout;
+	}
+
+	SD_METRICS(metrics.commandComplete(cmd, micros() - startTime);)
+
+	debug_d("[SD] send_cmd(%u): 0x%02x", cmd, d);
 	return d;
 }
 
+/*
+ * Wait for card to finish programming then check status for errors
+ */
+bool Card::check_status()
+{
+	uint8_t r1 = send_cmd(CMD13, 0);
+	uint8_t r2 = receive_byte();
+	deselect();
+	statusPending = false;
+
+	if(r1 != 0 || r2 != 0) {
+		debug_e("[SD] Status error 0x%02x%02x", r1, r2);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Terminate any open multiple block transfer and release the card
+ */
+bool Card::end_session()
+{
+	bool res{true};
+	switch(session) {
+	case Session::none:
+		return true;
+	case Session::read:
+		send_cmd(CMD12, 0); /* STOP_TRANSMISSION */
+		break;
+	case Session::write:
+		sessionTimer.stop();
+		res = xmit_datablock(nullptr, TK_STOP_TRAN);
+		if(!res) {
+			debug_e("[SD] STOP_TRAN error");
+		}
+		break;
+	}
+	deselect();
+	session = Session::none;
+	readAhead.count = 0;
+	return res;
+}
+
+void Card::sessionTimeout(void* param)
+{
+	static_cast<Card*>(param)->end_session();
+}
+
+/*
+ * Read sectors which follow on from the previous read
+ */
+bool Card::stream_read(storage_size_t sector, MutableBlockList blocks, size_t count)
+{
+	// Use any prefetched sectors first
+	if(readAhead.count != 0 && sector == readAhead.sector) {
+		auto n = std::min(count, readAhead.count);
+		for(size_t i = 0; i < n; ++i) {
+			memcpy(blocks[i], &readAhead.buffer[(readAhead.pos + i) << sectorSizeShift], sectorSize);
+		}
+		readAhead.pos += n;
+		readAhead.count -= n;
+		readAhead.sector += n;
+		sector += n;
+		blocks = blocks + n;
+		count -= n;
+	}
+
+	if(count != 0 && (session != Session::read || sector != sessionSector)) {
+		end_session();
+		auto address = sector;
+		if(!isBlockAddressed()) {
+			address <<= sectorSizeShift;
+		}
+		if(send_cmd(CMD18, address) != 0) {
+			debug_e("[SD] CMD18 error");
+			deselect();
+			return false;
+		}
+		session = Session::read;
+		sessionSector = sector;
+	}
+
+	// Card stays selected until session ends
+	for(size_t i = 0; i < count; ++i) {
+		if(!rcvr_datablock(blocks[i], sectorSize)) {
+			debug_e("[SD] rcvr error");
+			end_session();
+			return false;
+		}
+		++sessionSector;
+	}
+
+	queue_read_ahead();
+	return true;
+}
+
+void Card::queue_read_ahead()
+{
+	if(readAhead.capacity != 0 && !workerActive) {
+		readAhead.task.queue();
+	}
+}
+
+void Card::readAheadTask(void* param)
+{
+	static_cast<Card*>(param)->read_ahead();
+}
+
+/*
+ * Fetch next sectors from an open read session whilst application is idle
+ */
+void Card::read_ahead()
+{
+	if(session != Session::read || readAhead.count != 0) {
+		return;
+	}
+
+	auto count = size_t(std::min(storage_size_t(readAhead.capacity), sectorCount - sessionSector));
+	auto bufptr = readAhead.buffer.get();
+	for(size_t i = 0; i < count; ++i, bufptr += sectorSize) {
+		if(!rcvr_datablock(bufptr, sectorSize)) {
+			debug_e("[SD] read-ahead failed");
+			end_session();
+			return;
+		}
+	}
+
+	readAhead.pos = 0;
+	readAhead.count = count;
+	readAhead.sector = sessionSector;
+	sessionSector += count;
+}
+
+/*
+ * Write sectors using a multiple block write which remains open between calls
+ */
+bool Card::stream_write(storage_size_t sector, const BlockList& blocks, size_t count, bool writeBack)
+{
+	/*
+	 * Pre-erase covers only the part of the stream not yet written. The stream starts with the first
+	 * application write, and any other write into the range still to be pre-erased ends it.
+	 */
+	if(preEraseRemaining != 0) {
+		if(!streamStarted && !writeBack) {
+			streamStarted = true;
+			streamSector = sector;
+		}
+		if(streamStarted && sector != streamSector && sector < streamSector + preEraseRemaining &&
+		   sector + count > streamSector) {
+			preEraseRemaining = 0;
+		}
+	}
+	bool inStream = streamStarted && sector == streamSector && preEraseRemaining != 0;
+
+	if(session != Session::write || sector != sessionSector) {
+		end_session();
+		auto address = sector;
+		if(!isBlockAddressed()) {
+			address <<= sectorSizeShift;
+		}
+		CommandBatch batch(*this);
+		if(inStream && !writeBack && (cardType & CT_SDC)) {
+			// SET_WR_BLK_ERASE_COUNT
+			send_cmd(ACMD23, std::min(preEraseRemaining, 0x7fffffU));
+		}
+		if(send_cmd(CMD25, address) != 0) {
+			debug_e("[SD] CMD25 error");
+			deselect();
+			return false;
+		}
+		session = Session::write;
+		sessionSector = sector;
+	}
+
+	// Card stays selected until session ends
+	for(size_t i = 0; i < count; ++i) {
+		if(!xmit_datablock(blocks[i], TK_START_BLOCK_MULTI)) {
+			debug_e("[SD] xmit error");
+			preEraseRemaining = 0;
+			end_session();
+			return false;
+		}
+		++sessionSector;
+	}
+	if(inStream) {
+		preEraseRemaining -= std::min(preEraseRemaining, uint32_t(count));
+		streamSector += count;
+	}
+
+	if(!deferredBusy && !wait_busy()) {
+		end_session();
+		return false;
+	}
+
+	if(writeTimeoutMs != 0 && !workerActive) {
+		sessionTimer.startOnce();
+	}
+	return true;
+}
+
+bool Card::setCacheSize(size_t sectors)
+{
+	if(!cache.flush()) {
+		return false;
+	}
+	return cache.setCapacity(sectors);
+}
+
+void Card::setWriteStream(bool enable, uint32_t preEraseSectors, uint16_t timeoutMs)
+{
+	end_session();
+	writeStream = enable;
+	preEraseRemaining = enable ? preEraseSectors : 0;
+	streamStarted = false;
+	writeTimeoutMs = timeoutMs;
+	if(timeoutMs != 0) {
+		sessionTimer.initializeMs(timeoutMs, sessionTimeout, this);
+	}
+}
+
+bool Card::setReadStream(bool enable, size_t readAheadSectors)
+{
+	end_session();
+	readStream = enable;
+	readAhead.task.cancel();
+	readAhead.buffer.reset();
+	readAhead.capacity = 0;
+	if(!enable || readAheadSectors == 0) {
+		return true;
+	}
+
+	readAhead.buffer.reset(new(std::nothrow) uint8_t[readAheadSectors << sectorSizeShift]);
+	if(!readAhead.buffer) {
+		debug_e("[SD] Read-ahead buffer allocation failed");
+		return false;
+	}
+	readAhead.capacity = readAheadSectors;
+	return true;
+}
+
 bool Card::begin(uint8_t chipSelect, uint32_t freq)
 {
 	if(initialised) {
@@ -260,17 +714,13 @@ bool Card::begin(uint8_t chipSelect, uint32_t freq)
 	pinMode(chipSelect, OUTPUT);
 	digitalWrite(chipSelect, HIGH);
 
-	if(!spi.begin()) {
-		debug_e("[SD] SPI init failed");
+	if(!bus.attach()) {
 		return false;
 	}
 
-	const uint32_t maxFreq{40000000U};
-	if(freq == 0 || freq > maxFreq) {
-		freq = maxFreq;
-	}
-	SPISettings settings(freq, MSBFIRST, SPI_MODE0);
-	spi.beginTransaction(settings);
+	// Card identification must be performed at 400kHz or less
+	const uint32_t initFreq{400000U};
+	setFrequency(initFreq);
 
 	delayMicroseconds(10000);
 
@@ -279,32 +729,374 @@ bool Card::begin(uint8_t chipSelect, uint32_t freq)
 	if(cardType == 0) {
 		debug_e("[SD] init FAIL");
 	} else {
+		uint32_t cardFreq = mCSD.getTransferRate();
+		if(cardFreq == 0) {
+			// Invalid TRAN_SPEED so assume default speed mode
+			cardFreq = 25000000U;
+		}
+		setFrequency((freq == 0 || freq > cardFreq) ? cardFreq : freq);
+
+		// Only switch to high-speed mode if we can make use of it
+		if((freq == 0 || freq > cardFreq) && switch_high_speed()) {
+			cardFreq = mCSD.getTransferRate();
+			setFrequency((freq == 0 || freq > cardFreq) ? cardFreq : freq);
+		}
+
+		set_timeouts();
 		initialised = true;
-		debug_i("[SD] OK: TYPE %u", cardType);
+		debug_i("[SD] OK: TYPE %u, %u Hz", cardType, frequency);
 	}
 
 	deselect();
 
 	if(initialised) {
 		Disk::scanPartitions(*this);
+	} else {
+		bus.detach(*this);
 	}
 
 	return initialised;
 }
 
+/*
+ * Timeouts are 100 times the typical access time, limited to 100ms for reads and 250ms for writes.
+ * A zero or very small access time is not credible, so a lower limit is also applied.
+ * High capacity cards use the upper limits (500ms for writes on SDXC).
+ */
+void Card::set_timeouts()
+{
+	if(isBlockAddressed()) {
+		readTimeout = defaultReadTimeout;
+		// SDXC cards have more than 32GB
+		writeTimeout = (sectorCount > (0x800000000ULL >> sectorSizeShift)) ? 500000 : 250000;
+	} else {
+		auto accessTime = (mCSD.getAccessTime(frequency) + 999) / 1000;
+		readTimeout = std::clamp(accessTime * 100, minReadTimeout, maxReadTimeout);
+		writeTimeout = std::clamp((accessTime * 100) << mCSD.r2w_factor(), minWriteTimeout, maxWriteTimeout);
+	}
+	busyTimeout = writeTimeout;
+	debug_i("[SD] Timeouts: read %u us, write %u us", readTimeout, writeTimeout);
+}
+
+/*
+ * Erase timeout uses ERASE_TIMEOUT and ERASE_OFFSET from SD_STATUS if available,
+ * otherwise 250ms per erase unit. As for linux, allow at least 1 second.
+ */
+uint32_t Card::get_erase_timeout(size_t sectors)
+{
+	auto unitSectors = std::max(getBlockSize() >> sectorSizeShift, size_t(1));
+	uint32_t units = (sectors + unitSectors - 1) / unitSectors;
+	uint64_t ms = mSSR.getEraseTimeout(units);
+	if(ms == 0) {
+		ms = uint64_t(units) * 250;
+	}
+	ms = std::max(ms, uint64_t(1000));
+	// Keep within range of a micros() interval
+	return std::min(ms * 1000, uint64_t(INT32_MAX));
+}
+
+void Card::setFrequency(uint32_t freq)
+{
+	spiSettings = SPISettings(freq, MSBFIRST, SPI_MODE0);
+	bus.update(*this, spiSettings);
+	frequency = freq;
+}
+
+/*
+ * Another device needs the SPI bus, so close any open session.
+ * Not possible whilst a command sequence is in progress, e.g. from within a `readTo()` callback.
+ */
+bool Card::yieldBus()
+{
+	if(batchDepth != 0) {
+		return false;
+	}
+	end_session();
+	deselect();
+	return true;
+}
+
+bool Card::read_csd()
+{
+	bool res = send_cmd(CMD9, 0) == 0 && rcvr_datablock(&mCSD, sizeof(mCSD));
+	deselect();
+	if(!res) {
+		debug_e("[SD] Read CSD failed");
+		return false;
+	}
+	mCSD.bswap();
+	return true;
+}
+
+/*
+ * Read SD Configuration Register
+ */
+bool Card::read_scr()
+{
+	bool res = send_cmd(ACMD51, 0) == 0 && rcvr_datablock(&mSCR, sizeof(mSCR));
+	deselect();
+	if(!res) {
+		debug_w("[SD] Read SCR failed");
+		mSCR = {};
+		return false;
+	}
+	mSCR.bswap();
+	return true;
+}
+
+/*
+ * Set length of next multiple block transfer so it completes without CMD12 or STOP_TRAN.
+ * Returns false if not supported by card, in which case the transfer is open-ended.
+ */
+bool Card::set_block_count(size_t count)
+{
+	if(!blockCountSupported) {
+		return false;
+	}
+	// MMC has only 16 bits for the count, bit 31 being the reliable write flag
+	if((cardType & CT_MMC) && count > 0xffff) {
+		return false;
+	}
+	if(send_cmd(CMD23, count) == 0) {
+		return true;
+	}
+	debug_w("[SD] CMD23 rejected, using open-ended transfers");
+	blockCountSupported = false;
+	return false;
+}
+
+/*
+ * Read SD Status register (R2 response followed by data block)
+ */
+bool Card::read_ssr()
+{
+	bool res = send_cmd(ACMD13, 0) == 0 && receive_byte() == 0 && rcvr_datablock(&mSSR, sizeof(mSSR));
+	deselect();
+	if(!res) {
+		debug_w("[SD] Read SSR failed");
+		mSSR = {};
+		return false;
+	}
+	mSSR.bswap();
+	return true;
+}
+
+/*
+ * Check or set a function in group 1 (access mode), leaving other groups unchanged
+ */
+bool Card::switch_function(bool set, uint8_t function, SwitchStatus& status)
+{
+	uint32_t arg = (set ? 0x80000000 : 0) | 0x00fffff0 | (function & 0x0f);
+	bool res = send_cmd(CMD6, arg) == 0 && rcvr_datablock(&status, sizeof(status));
+	deselect();
+	if(!res) {
+		debug_e("[SD] CMD6 failed");
+		return false;
+	}
+	status.bswap();
+	return true;
+}
+
+bool Card::switch_high_speed()
+{
+	// SWITCH_FUNC is supported by SD v1.10 and later, indicated by command class 10
+	if((cardType & CT_SD2) == 0 || (mCSD.ccc() & (1U << 10)) == 0) {
+		return false;
+	}
+
+	SwitchStatus status;
+	if(!switch_function(false, uint8_t(AccessMode::highSpeed), status)) {
+		return false;
+	}
+	if(!status.supports(AccessMode::highSpeed) || status.group1_result() != uint8_t(AccessMode::highSpeed)) {
+		debug_i("[SD] High-speed mode not supported");
+		return false;
+	}
+
+	if(!switch_function(true, uint8_t(AccessMode::highSpeed), status) ||
+	   status.group1_result() != uint8_t(AccessMode::highSpeed)) {
+		debug_w("[SD] High-speed switch failed");
+		return false;
+	}
+
+	// Card switches within 8 clocks of the status block, and TRAN_SPEED then reflects the new mode
+	accessMode = AccessMode::highSpeed;
+	return read_csd();
+}
+
 void Card::end()
 {
 	if(!initialised) {
 		return;
 	}
 
-	spi.end();
+	requests.flush();
+	cache.flush();
+	cache.invalidate();
+	end_session();
+	readAhead.task.cancel();
+	deselect();
+	bus.detach(*this);
 	initialised = false;
 }
 
+bool Card::submit(RequestQueue::Kind kind, Priority priority, storage_size_t address, void* buffer,
+				  storage_size_t size, Callback callback, bool burst)
+{
+	CHECK_INIT()
+
+	if(workerActive) {
+		debug_e("[SD] Card in use by worker");
+		return false;
+	}
+
+	if(((address | size) & (sectorSize - 1)) != 0) {
+		debug_e("[SD] Request must be sector-aligned");
+		return false;
+	}
+
+	auto sector = address >> sectorSizeShift;
+	auto count = size >> sectorSizeShift;
+	if(count == 0 || sector + count > sectorCount) {
+		debug_e("[SD] Request out of range");
+		return false;
+	}
+
+	requests.submit({kind, priority, sector, size_t(count), static_cast<uint8_t*>(buffer), callback, burst});
+	return true;
+}
+
+/*
+ * Validate scatter-gather request and return total number of sectors, 0 if invalid
+ */
+template <typename T> size_t Card::check_segments(storage_size_t address, const SegmentT<T>* segments, size_t count)
+{
+	if((address & (sectorSize - 1)) != 0) {
+		debug_e("[SD] Request must be sector-aligned");
+		return 0;
+	}
+
+	size_t sectors{0};
+	for(size_t i = 0; i < count; ++i) {
+		auto size = segments[i].size;
+		if(size == 0 || (size & (sectorSize - 1)) != 0) {
+			debug_e("[SD] Segment size must be a multiple of sector size");
+			return 0;
+		}
+		sectors += size >> sectorSizeShift;
+	}
+
+	if(sectors == 0 || (address >> sectorSizeShift) + sectors > sectorCount) {
+		debug_e("[SD] Request out of range");
+		return 0;
+	}
+
+	return sectors;
+}
+
+bool Card::readv(storage_size_t address, const MutableSegment* segments, size_t count)
+{
+	CHECK_INIT()
+
+	auto sectors = check_segments(address, segments, count);
+	return sectors != 0 && read_blocks(address >> sectorSizeShift, {segments, sectorSize}, sectors);
+}
+
+bool Card::writev(storage_size_t address, const Segment* segments, size_t count)
+{
+	CHECK_INIT()
+
+	auto sectors = check_segments(address, segments, count);
+	return sectors != 0 && write_blocks(address >> sectorSizeShift, {segments, sectorSize}, sectors);
+}
+
+bool Card::readTo(storage_size_t address, storage_size_t size, BlockCallback callback)
+{
+	CHECK_INIT()
+
+	if(((address | size) & (sectorSize - 1)) != 0) {
+		debug_e("[SD] Request must be sector-aligned");
+		return false;
+	}
+
+	auto sector = address >> sectorSizeShift;
+	auto count = size >> sectorSizeShift;
+	if(count == 0 || sector + count > sectorCount) {
+		debug_e("[SD] Request out of range");
+		return false;
+	}
+
+	if(!callback) {
+		return false;
+	}
+
+	// Callback must see data as it is on the card
+	if(!cache.flush()) {
+		return false;
+	}
+
+	std::unique_ptr<uint8_t[]> block(new(std::nothrow) uint8_t[sectorSize]);
+	if(!block) {
+		return false;
+	}
+
+	end_session();
+
+	// Convert byte address to sector number for block devices
+	address = isBlockAddressed() ? sector : sector << sectorSizeShift;
+
+	// Range may exceed CMD23 block count so always use open-ended transfer
+	CommandBatch batch(*this);
+	if(send_cmd(CMD18, address) == 0) {
+		for(; count != 0; --count) {
+			if(!rcvr_datablock(block.get(), sectorSize)) {
+				debug_e("[SD] rcvr error");
+				break;
+			}
+			if(!callback(block.get(), sectorSize)) {
+				break;
+			}
+		}
+		send_cmd(CMD12, 0); /* STOP_TRANSMISSION */
+	}
+	deselect();
+
+	return count == 0;
+}
+
+bool Card::submitRead(storage_size_t address, void* dst, size_t size, Callback callback, Priority priority)
+{
+	return submit(RequestQueue::Kind::read, priority, address, dst, size, callback);
+}
+
+bool Card::submitWrite(storage_size_t address, const void* src, size_t size, Callback callback, Priority priority)
+{
+	return submit(RequestQueue::Kind::write, priority, address, const_cast<void*>(src), size, callback);
+}
+
+bool Card::submitBurst(storage_size_t address, const void* src, size_t size, Callback callback, Priority priority)
+{
+	return submit(RequestQueue::Kind::write, priority, address, const_cast<void*>(src), size, callback, true);
+}
+
+bool Card::submitDiscard(storage_size_t address, storage_size_t size, Callback callback)
+{
+	return submit(RequestQueue::Kind::erase, Priority::background, address, nullptr, size, callback);
+}
+
 uint8_t Card::init()
 {
-	// init send 0xFF x 80
+	// Card state unknown
+	busy = true;
+	readTimeout = defaultReadTimeout;
+	writeTimeout = busyTimeout = defaultWriteTimeout;
+	statusPending = false;
+	accessMode = AccessMode::defaultSpeed;
+
+	// init send 0xFF x 80, with card deselected
+	if(!bus.acquire(*this, spiSettings)) {
+		return 0;
+	}
 	uint8_t tmp[80 / 8];
 	memset(tmp, 0xff, sizeof(tmp));
 	spi.transfer(tmp, sizeof(tmp));
@@ -327,8 +1119,8 @@ uint8_t Card::init()
 	// Enter Idle state
 	if(send_cmd(CMD8, 0x1AA) == 1) { /* SDv2? */
 		debug_i("[SD] Sdv2 ?");
-		uint8_t buf[4]{0xff, 0xff, 0xff, 0xff};
-		spi.transfer(buf, sizeof(buf));
+		uint8_t buf[4];
+		receive(buf, sizeof(buf));
 		debug_hex(INFO, "[SD] IF COND", buf, sizeof(buf));
 
 		// Check card can work at vdd range of 2.7-3.6V
@@ -357,12 +1149,18 @@ uint8_t Card::init()
 			return 0;
 		}
 
-		memset(buf, 0xFF, sizeof(buf));
-		spi.transfer(buf, sizeof(buf));
+		receive(buf, sizeof(buf));
 		ty = (buf[0] & 0x40) ? CT_SD2 | CT_BLOCK : CT_SD2; /* SDv2 */
 		debug_hex(INFO, "[SD] OCR", buf, sizeof(buf));
+#if !SD_ENABLE_BYTE_ADDRESSING
+		if((ty & CT_BLOCK) == 0) {
+			debug_e("[SD] Standard capacity cards not supported (SD_ENABLE_BYTE_ADDRESSING=0)");
+			return 0;
+		}
+#endif
 
 	} else { /* SDv1 or MMCv3 */
+#if SD_ENABLE_BYTE_ADDRESSING
 		debug_i("[SD] Sdv1 / MMCv3 ?");
 		uint8_t cmd;
 		if(send_cmd(ACMD41, 0) <= 1) {
@@ -388,16 +1186,18 @@ uint8_t Card::init()
 			debug_i("[SD] CMD16 != 0");
 			return 0;
 		}
+#else
+		debug_e("[SD] SDv1 / MMC cards not supported (SD_ENABLE_BYTE_ADDRESSING=0)");
+		return 0;
+#endif
 	}
 
 	// Get number of sectors on the disk
 	assert(ty != 0);
 
-	if(send_cmd(CMD9, 0) != 0 || !rcvr_datablock(&mCSD, sizeof(mCSD))) {
-		debug_e("[SD] Read CSD failed");
+	if(!read_csd()) {
 		return 0;
 	}
-	mCSD.bswap();
 
 	uint64_t size = mCSD.getSize();
 #ifndef ENABLE_STORAGE_SIZE64
@@ -418,6 +1218,17 @@ uint8_t Card::init()
 	}
 	mCID.bswap();
 
+	// Card configuration and geometry are optional
+	mSCR = {};
+	mSSR = {};
+	if(ty & CT_SDC) {
+		read_scr();
+		read_ssr();
+	}
+
+	// MMC cards from version 3.1 support CMD23. Any others fall back when the command is rejected.
+	blockCountSupported = (ty & CT_MMC) || mSCR.supportsSetBlockCount();
+
 	return ty;
 }
 
@@ -425,20 +1236,49 @@ bool Card::raw_sector_read(storage_size_t address, void* dst, size_t size)
 {
 	CHECK_INIT()
 
+	return read_blocks(address, {dst, sectorSize}, size);
+}
+
+/*
+ * Read via the sector cache if enabled
+ */
+bool Card::read_blocks(storage_size_t sector, const MutableBlockList& blocks, size_t count)
+{
+	if(cache) {
+		return cache.read(sector, blocks, count);
+	}
+	return read_sectors(sector, blocks, count);
+}
+
+bool Card::read_sectors(storage_size_t address, const MutableBlockList& blocks, size_t size)
+{
+	if(readStream) {
+		bool sequential = (address == lastReadEnd);
+		lastReadEnd = address + size;
+		if(sequential) {
+			return stream_read(address, blocks, size);
+		}
+	}
+
+	end_session();
+
 	// Convert byte address to sector number for block devices
-	if((cardType & CT_BLOCK) == 0) {
+	if(!isBlockAddressed()) {
 		address <<= sectorSizeShift;
 	}
 
+	CommandBatch batch(*this);
+	bool closed = (size > 1) && set_block_count(size);
 	uint8_t cmd = (size > 1) ? CMD18 : CMD17; /*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
 	if(send_cmd(cmd, address) == 0) {
-		for(auto bufptr = static_cast<uint8_t*>(dst); size != 0; --size, bufptr += sectorSize) {
-			if(!rcvr_datablock(bufptr, sectorSize)) {
+		for(size_t i = 0; size != 0; --size, ++i) {
+			if(!rcvr_datablock(blocks[i], sectorSize)) {
 				debug_e("[SD] rcvr error");
 				break;
 			}
 		}
-		if(cmd == CMD18) {
+		// Closed-ended transfer only needs stopping if incomplete
+		if(cmd == CMD18 && (!closed || size != 0)) {
 			send_cmd(CMD12, 0); /* STOP_TRANSMISSION */
 		}
 	}
@@ -451,34 +1291,59 @@ bool Card::raw_sector_write(storage_size_t address, const void* src, size_t size
 {
 	CHECK_INIT()
 
+	return write_blocks(address, {src, sectorSize}, size);
+}
+
+/*
+ * Write via the sector cache if enabled
+ */
+bool Card::write_blocks(storage_size_t sector, const BlockList& blocks, size_t count)
+{
+	if(cache) {
+		return cache.write(sector, blocks, count);
+	}
+	return write_sectors(sector, blocks, count);
+}
+
+bool Card::write_sectors(storage_size_t address, const BlockList& blocks, size_t size, bool writeBack)
+{
+	if(writeStream) {
+		return stream_write(address, blocks, size, writeBack);
+	}
+
+	end_session();
+
 	// If required, convert sector address to byte offset
-	if((cardType & CT_BLOCK) == 0) {
+	if(!isBlockAddressed()) {
 		address <<= sectorSizeShift;
 	}
 
 	if(size == 1) {
 		// Single block write
-		if((send_cmd(CMD24, address) == 0) && xmit_datablock(src, TK_START_BLOCK_SINGLE)) {
+		if((send_cmd(CMD24, address) == 0) && xmit_datablock(blocks[0], TK_START_BLOCK_SINGLE)) {
 			size = 0;
 		} else {
 			debug_e("[SD] CMD24 error");
 		}
 	} else {
 		// Multiple block write
-		if(cardType & CT_SDC) {
+		CommandBatch batch(*this);
+		bool closed = set_block_count(size);
+		if(!closed && (cardType & CT_SDC)) {
 			// SET_WR_BLK_ERASE_COUNT
 			send_cmd(ACMD23, size);
 		}
 		//  WRITE_MULTIPLE_BLOCK
 		if(send_cmd(CMD25, address) == 0) {
-			for(auto bufptr = static_cast<const uint8_t*>(src); size != 0; --size, bufptr += sectorSize) {
-				if(!xmit_datablock(bufptr, TK_START_BLOCK_MULTI)) {
+			for(size_t i = 0; size != 0; --size, ++i) {
+				if(!xmit_datablock(blocks[i], TK_START_BLOCK_MULTI)) {
 					debug_e("[SD] xmit error");
 					break;
 				}
 			}
 
-			if(!xmit_datablock(0, TK_STOP_TRAN)) {
+			// Closed-ended transfer only needs stopping if incomplete
+			if((!closed || size != 0) && !xmit_datablock(0, TK_STOP_TRAN)) {
 				debug_e("[SD] STOP_TRAN error");
 				size = 1;
 			}
@@ -486,25 +1351,36 @@ bool Card::raw_sector_write(storage_size_t address, const void* src, size_t size
 	}
 	deselect();
 
-	return size == 0;
+	if(size != 0) {
+		return false;
+	}
+
+	// Otherwise card finishes programming in background and next command waits
+	return deferredBusy || check_status();
 }
 
 bool Card::raw_sector_erase_range(storage_size_t address, size_t size)
 {
 	CHECK_INIT()
 
-	if((cardType & CT_BLOCK) == 0) {
+	cache.invalidate(address, size);
+	end_session();
+	auto timeout = get_erase_timeout(size);
+
+	if(!isBlockAddressed()) {
 		address <<= sectorSizeShift;
 		size <<= sectorSizeShift;
 	}
 
 	// ERASE_WR_BLK_START, ERASE_WR_BLK_END, ERASE / DISCARD
+	CommandBatch batch(*this);
 	bool res =
 		send_cmd(CMD32, address) == 0 && send_cmd(CMD33, address + size - 1) == 0 && send_cmd(CMD38, 0x00000001) == 0;
+	busyTimeout = timeout;
 
 	deselect();
 
-	return res;
+	return res && (deferredBusy || check_status());
 }
 
 bool Card::raw_sync()
@@ -513,8 +1389,18 @@ bool Card::raw_sync()
 		return false;
 	}
 
+	// Complete any queued requests
+	bool res = requests.flush();
+	res &= cache.flush();
+	res &= end_session();
+
+	// Wait for programming to complete and report any errors from deferred writes
+	if(statusPending) {
+		return check_status() && res;
+	}
+
 	// Make sure that no pending write process
-	bool res = select();
+	res &= select();
 	deselect();
 	return res;
 }
@@ -0,0 +1,831 @@
+/*
+	SPI-mode SD card emulator for the Host architecture.
+*/
+
+#ifdef ARCH_HOST
+
+// Host builds may be 32-bit but images can exceed 2GB
+#define _FILE_OFFSET_BITS 64
+
+#include "include/Storage/SD/Emulator.h"
+#include <Clock.h>
+#include <debug_progmem.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+namespace
+{
+// R1 response bits
+enum R1 : uint8_t {
+	R1_IDLE = 0x01,
+	R1_ERASE_RESET = 0x02,
+	R1_ILLEGAL_COMMAND = 0x04,
+	R1_CRC_ERROR = 0x08,
+	R1_ERASE_SEQUENCE_ERROR = 0x10,
+	R1_ADDRESS_ERROR = 0x20,
+	R1_PARAMETER_ERROR = 0x40,
+};
+
+// Data tokens
+enum Token : uint8_t {
+	TK_START_BLOCK_SINGLE = 0xfe,
+	TK_START_BLOCK_MULTI = 0xfc,
+	TK_STOP_TRAN = 0xfd,
+	TK_DATA_ACCEPTED = 0xe5,
+	TK_ERROR_OUT_OF_RANGE = 0x08,
+};
+
+uint8_t crc7(const uint8_t* data, size_t len)
+{
+	uint8_t crc{0};
+	while(len--) {
+		uint8_t d = *data++;
+		for(unsigned i = 0; i < 8; ++i, d <<= 1) {
+			crc <<= 1;
+			if((d ^ crc) & 0x80) {
+				crc ^= 0x09;
+			}
+		}
+	}
+	return crc & 0x7f;
+}
+
+uint16_t crc16(const uint8_t* data, size_t len)
+{
+	uint16_t crc{0};
+	while(len--) {
+		crc ^= uint16_t(*data++) << 8;
+		for(unsigned i = 0; i < 8; ++i) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/*
+ * Write a big-endian register bit field, as read by `CSD::readBits`
+ */
+void setBits(uint8_t* reg, size_t regSize, unsigned start, unsigned size, uint32_t value)
+{
+	for(unsigned i = 0; i < size; ++i, value >>= 1) {
+		unsigned bit = start + i;
+		uint8_t& b = reg[regSize - 1 - (bit / 8)];
+		uint8_t mask = 1 << (bit % 8);
+		b = (value & 1) ? (b | mask) : (b & ~mask);
+	}
+}
+
+} // namespace
+
+namespace Storage::SD
+{
+Emulator::Emulator(const String& filename, uint64_t size, Kind kind)
+	: SPIExt(SPISettings(400000, MSBFIRST, SPI_MODE0)), filename(filename), sectorCount(size >> sectorSizeShift),
+	  kind(kind)
+{
+	buildCSD();
+	buildCID();
+	buildSSR();
+	buildSCR();
+}
+
+bool Emulator::begin()
+{
+	if(fd < 0) {
+		fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+		if(fd < 0) {
+			debug_e("[SDEMU] Failed to open '%s'", filename.c_str());
+			return false;
+		}
+		// Extending the file leaves a hole, so unwritten sectors take no space and read as zeroes
+		if(::lseek(fd, 0, SEEK_END) < off_t(getSize()) && ::ftruncate(fd, getSize()) != 0) {
+			debug_e("[SDEMU] Failed to size '%s'", filename.c_str());
+			end();
+			return false;
+		}
+	}
+
+	// Power cycle
+	state = State::powerUp;
+	if(highSpeed) {
+		highSpeed = false;
+		buildCSD();
+	}
+	rx = Rx::command;
+	read = Read::none;
+	appCmd = false;
+	acmd41Count = 0;
+	cmdLen = 0;
+	blockCount = 0;
+	busyTime = 0;
+	eraseStartSet = eraseEndSet = false;
+	preEraseCount = 0;
+	preEraseEnd = 0;
+	outBuf.clear();
+	outPos = 0;
+	return true;
+}
+
+void Emulator::end()
+{
+	if(fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+uint32_t Emulator::transfer32(uint32_t val, uint8_t bits)
+{
+	uint32_t res{0};
+	for(int shift = bits - 8; shift >= 0; shift -= 8) {
+		res = (res << 8) | exchange(val >> shift);
+	}
+	return res;
+}
+
+void Emulator::transfer(uint8_t* buffer, size_t size)
+{
+	for(size_t i = 0; i < size; ++i) {
+		buffer[i] = exchange(buffer[i]);
+	}
+}
+
+void Emulator::send(const void* data, size_t size)
+{
+	auto p = static_cast<const uint8_t*>(data);
+	for(size_t i = 0; i < size; ++i) {
+		exchange(p[i]);
+	}
+}
+
+void Emulator::receive(void* data, size_t size)
+{
+	auto p = static_cast<uint8_t*>(data);
+	for(size_t i = 0; i < size; ++i) {
+		p[i] = exchange(0xff);
+	}
+}
+
+/*
+ * Clock one byte. Output is determined before input is decoded so responses
+ * are always delayed by at least one byte.
+ */
+uint8_t Emulator::exchange(uint8_t mosi)
+{
+	++stats.bytes;
+	uint8_t miso = nextOutput();
+	receive(mosi);
+	return miso;
+}
+
+uint8_t Emulator::nextOutput()
+{
+	if(outPos < outBuf.size()) {
+		uint8_t d = outBuf[outPos++];
+		if(outPos == outBuf.size()) {
+			outBuf.clear();
+			outPos = 0;
+		}
+		return d;
+	}
+
+	if(read != Read::none) {
+		if(int32_t(micros() - readReadyTime) < 0) {
+			return 0xff;
+		}
+		if(rwSector >= sectorCount) {
+			debug_w("[SDEMU] Read past end of card");
+			read = Read::none;
+			return TK_ERROR_OUT_OF_RANGE;
+		}
+		uint8_t block[sectorSize];
+		if(!readSectors(rwSector, block, 1)) {
+			read = Read::none;
+			return TK_ERROR_OUT_OF_RANGE;
+		}
+		++stats.blocksRead;
+		++rwSector;
+		if(read == Read::single || (rwCount != 0 && --rwCount == 0)) {
+			read = Read::none;
+		} else {
+			readReadyTime = micros() + timing.readAccessUs;
+		}
+		outBuf.clear();
+		outPos = 0;
+		queueBlock(block, sizeof(block));
+		return nextOutput();
+	}
+
+	return isBusy() ? 0x00 : 0xff;
+}
+
+void Emulator::receive(uint8_t mosi)
+{
+	switch(rx) {
+	case Rx::data:
+		rxBlock.push_back(mosi);
+		if(rxBlock.size() == sectorSize + 2) {
+			writeBlock();
+		}
+		return;
+
+	case Rx::dataToken:
+		if(!writeMulti && mosi == TK_START_BLOCK_SINGLE) {
+			rx = Rx::data;
+			rxBlock.clear();
+			return;
+		}
+		if(writeMulti && mosi == TK_START_BLOCK_MULTI) {
+			rx = Rx::data;
+			rxBlock.clear();
+			return;
+		}
+		if(writeMulti && mosi == TK_STOP_TRAN) {
+			// One byte delay before busy
+			rx = Rx::command;
+			outBuf.push_back(0xff);
+			endPreErase();
+			setBusy(timing.writeBusyUs);
+			return;
+		}
+		// Anything other than a valid command frame is ignored
+		if((mosi & 0xc0) != 0x40) {
+			return;
+		}
+		rx = Rx::command;
+		break;
+
+	case Rx::command:
+		break;
+	}
+
+	if(cmdLen == 0 && (mosi & 0xc0) != 0x40) {
+		return;
+	}
+	cmdFrame[cmdLen++] = mosi;
+	if(cmdLen < sizeof(cmdFrame)) {
+		return;
+	}
+	cmdLen = 0;
+
+	++stats.commands;
+	uint8_t cmd = cmdFrame[0] & 0x3f;
+	uint32_t arg = (cmdFrame[1] << 24) | (cmdFrame[2] << 16) | (cmdFrame[3] << 8) | cmdFrame[4];
+
+	if(isBusy()) {
+		debug_w("[SDEMU] CMD%u ignored, card busy", cmd);
+		return;
+	}
+
+	// CRC is only checked for commands issued before SPI mode is fully established
+	if(cmd == 0 || cmd == 8) {
+		uint8_t crc = (crc7(cmdFrame, 5) << 1) | 0x01;
+		if(cmdFrame[5] != crc) {
+			debug_w("[SDEMU] CMD%u CRC error: 0x%02x, expected 0x%02x", cmd, cmdFrame[5], crc);
+			respond(R1_CRC_ERROR | R1_IDLE);
+			return;
+		}
+	}
+
+	command(cmd, arg);
+}
+
+void Emulator::command(uint8_t cmd, uint32_t arg)
+{
+	bool isApp = appCmd;
+	appCmd = false;
+	if(isApp) {
+		++stats.acmd[cmd];
+	} else {
+		++stats.cmd[cmd];
+	}
+
+	checkClock(cmd);
+
+	// Block count only applies to the command immediately following
+	auto count = blockCount;
+	blockCount = 0;
+
+	// Any command aborts a read in progress
+	bool wasReading = (read != Read::none);
+	read = Read::none;
+	outBuf.clear();
+	outPos = 0;
+
+	if(state == State::powerUp && cmd != 0) {
+		// Card not yet in SPI mode
+		return;
+	}
+
+	if(isApp) {
+		switch(cmd) {
+		case 13: { // SD_STATUS
+			if(state != State::ready) {
+				break;
+			}
+			uint8_t r2{0};
+			respond(r1(), &r2, 1);
+			outBuf.push_back(0xff);
+			queueBlock(ssr, sizeof(ssr));
+			return;
+		}
+
+		case 23: // SET_WR_BLK_ERASE_COUNT
+			if(state != State::ready) {
+				break;
+			}
+			preEraseCount = arg & 0x7fffff;
+			respond(r1());
+			return;
+
+		case 41: { // SD_SEND_OP_COND
+			// SDHC cards never leave idle state unless host indicates support
+			bool hcs = arg & (1U << 30);
+			if(state == State::idle && (hcs || kind != Kind::sdhc) && ++acmd41Count > timing.initRetries) {
+				state = State::ready;
+			}
+			respond(r1());
+			return;
+		}
+
+		case 51: // SEND_SCR
+			if(state != State::ready) {
+				break;
+			}
+			respond(r1());
+			outBuf.push_back(0xff);
+			queueBlock(scr, sizeof(scr));
+			return;
+
+		default:
+			break;
+		}
+		respond(r1() | R1_ILLEGAL_COMMAND);
+		return;
+	}
+
+	switch(cmd) {
+	case 0: // GO_IDLE_STATE
+		state = State::idle;
+		acmd41Count = 0;
+		rx = Rx::command;
+		eraseStartSet = eraseEndSet = false;
+		respond(R1_IDLE);
+		return;
+
+	case 6: // SWITCH_FUNC
+		if(state != State::ready || kind == Kind::sdv1) {
+			break;
+		}
+		respond(r1());
+		outBuf.push_back(0xff);
+		switchFunction(arg);
+		return;
+
+	case 8: { // SEND_IF_COND
+		if(kind == Kind::sdv1) {
+			break;
+		}
+		uint8_t r7[]{0x00, 0x00, uint8_t((arg >> 8) & 0x0f), uint8_t(arg)};
+		respond(r1(), r7, sizeof(r7));
+		return;
+	}
+
+	case 9: // SEND_CSD
+	case 10: // SEND_CID
+		if(state != State::ready) {
+			break;
+		}
+		respond(r1());
+		outBuf.push_back(0xff);
+		queueBlock((cmd == 9) ? csd : cid, 16);
+		return;
+
+	case 12: // STOP_TRANSMISSION
+		if(state != State::ready) {
+			break;
+		}
+		// Stuff byte, then R1b
+		outBuf.push_back(0xff);
+		respond(r1());
+		if(wasReading) {
+			setBusy(0);
+		}
+		return;
+
+	case 13: { // SEND_STATUS
+		uint8_t r2{0};
+		respond(r1(), &r2, 1);
+		return;
+	}
+
+	case 16: // SET_BLOCKLEN
+		if(state != State::ready) {
+			break;
+		}
+		respond((kind == Kind::sdhc || arg == sectorSize) ? r1() : r1() | R1_PARAMETER_ERROR);
+		return;
+
+	case 23: // SET_BLOCK_COUNT
+		if(state != State::ready || kind == Kind::sdv1) {
+			break;
+		}
+		blockCount = arg;
+		respond(r1());
+		return;
+
+	case 17: // READ_SINGLE_BLOCK
+	case 18: // READ_MULTIPLE_BLOCK
+	case 24: // WRITE_BLOCK
+	case 25: { // WRITE_MULTIPLE_BLOCK
+		if(state != State::ready) {
+			break;
+		}
+		uint32_t sector;
+		if(!addressToSector(arg, sector)) {
+			respond(r1() | R1_ADDRESS_ERROR);
+			return;
+		}
+		if(sector >= sectorCount) {
+			respond(r1() | R1_PARAMETER_ERROR);
+			return;
+		}
+		respond(r1());
+		rwCount = (cmd == 18 || cmd == 25) ? count : 0;
+		if(cmd == 17 || cmd == 18) {
+			startRead((cmd == 17) ? Read::single : Read::multi, sector);
+		} else {
+			rwSector = sector;
+			writeMulti = (cmd == 25);
+			// Pre-erase count applies only to the next multiple block write
+			preEraseEnd = (writeMulti && preEraseCount != 0) ? std::min(sector + preEraseCount, sectorCount) : 0;
+			preEraseCount = 0;
+			rx = Rx::dataToken;
+		}
+		return;
+	}
+
+	case 32: // ERASE_WR_BLK_START_ADDR
+	case 33: { // ERASE_WR_BLK_END_ADDR
+		if(state != State::ready) {
+			break;
+		}
+		// Byte addresses are rounded down to the containing block
+		uint32_t sector = (kind == Kind::sdhc) ? arg : arg >> sectorSizeShift;
+		if(sector >= sectorCount) {
+			respond(r1() | R1_PARAMETER_ERROR);
+			return;
+		}
+		if(cmd == 32) {
+			eraseStart = sector;
+			eraseStartSet = true;
+			eraseEndSet = false;
+		} else if(!eraseStartSet) {
+			respond(r1() | R1_ERASE_SEQUENCE_ERROR);
+			return;
+		} else {
+			eraseEnd = sector;
+			eraseEndSet = true;
+		}
+		respond(r1());
+		return;
+	}
+
+	case 38: // ERASE
+		if(state != State::ready) {
+			break;
+		}
+		if(!eraseStartSet || !eraseEndSet || eraseEnd < eraseStart) {
+			eraseStartSet = eraseEndSet = false;
+			respond(r1() | R1_ERASE_SEQUENCE_ERROR);
+			return;
+		}
+		respond(r1());
+		erase();
+		return;
+
+	case 55: // APP_CMD
+		appCmd = true;
+		respond(r1());
+		return;
+
+	case 58: { // READ_OCR
+		// 2.7 - 3.6V
+		uint32_t ocr = 0x00ff8000;
+		if(state == State::ready) {
+			ocr |= 0x80000000;
+			if(kind == Kind::sdhc) {
+				ocr |= 0x40000000;
+			}
+		}
+		uint8_t r3[]{uint8_t(ocr >> 24), uint8_t(ocr >> 16), uint8_t(ocr >> 8), uint8_t(ocr)};
+		respond(r1(), r3, sizeof(r3));
+		return;
+	}
+
+	default:
+		break;
+	}
+
+	respond(r1() | R1_ILLEGAL_COMMAND);
+}
+
+/*
+ * Queue a response after the command response time (NCR) of one byte
+ */
+void Emulator::respond(uint8_t r1, const void* data, size_t len)
+{
+	outBuf.push_back(0xff);
+	outBuf.push_back(r1);
+	auto p = static_cast<const uint8_t*>(data);
+	outBuf.insert(outBuf.end(), p, p + len);
+}
+
+void Emulator::queueBlock(const void* data, size_t len)
+{
+	auto p = static_cast<const uint8_t*>(data);
+	outBuf.push_back(TK_START_BLOCK_SINGLE);
+	outBuf.insert(outBuf.end(), p, p + len);
+	uint16_t crc = crc16(p, len);
+	outBuf.push_back(crc >> 8);
+	outBuf.push_back(crc & 0xff);
+}
+
+/*
+ * Only function group 1 (access mode) is implemented: other groups support function 0 only
+ */
+void Emulator::switchFunction(uint32_t arg)
+{
+	uint8_t status[64]{};
+	auto set = [&status](unsigned start, unsigned size, uint32_t value) {
+		setBits(status, sizeof(status), start, size, value);
+	};
+
+	set(496, 16, 100); // Maximum current (mA)
+	for(unsigned group = 2; group <= 6; ++group) {
+		set(400 + (group - 1) * 16, 16, 0x8001);
+	}
+	set(400, 16, 0x8003); // Group 1: default and high speed
+
+	// Result is requested function, current function if 0xF, or 0xF if not supported
+	bool mode = arg & 0x80000000;
+	unsigned function = arg & 0x0f;
+	if(function == 0x0f) {
+		function = highSpeed ? 1 : 0;
+	} else if(function > 1) {
+		function = 0x0f;
+	} else if(mode) {
+		highSpeed = (function == 1);
+		buildCSD();
+	}
+	set(376, 4, function);
+	set(368, 8, 1); // Data structure version
+
+	queueBlock(status, sizeof(status));
+}
+
+void Emulator::startRead(Read mode, uint32_t sector)
+{
+	read = mode;
+	rwSector = sector;
+	readReadyTime = micros() + timing.readAccessUs;
+}
+
+void Emulator::writeBlock()
+{
+	rx = writeMulti ? Rx::dataToken : Rx::command;
+
+	if(rwSector >= sectorCount || !writeSectors(rwSector, rxBlock.data(), 1)) {
+		// Write error
+		outBuf.push_back(0xed);
+		writeMulti = false;
+		rx = Rx::command;
+		endPreErase();
+		return;
+	}
+
+	++stats.blocksWritten;
+	++rwSector;
+	if(rwCount != 0 && --rwCount == 0) {
+		// Closed-ended transfer complete
+		writeMulti = false;
+		rx = Rx::command;
+		endPreErase();
+	}
+	outBuf.push_back(TK_DATA_ACCEPTED);
+	setBusy(timing.writeBusyUs);
+}
+
+/*
+ * Contents of pre-erased blocks which were not written are undefined,
+ * so fill them with a pattern rather than leaving the previous data in place
+ */
+void Emulator::endPreErase()
+{
+	if(rwSector >= preEraseEnd) {
+		preEraseEnd = 0;
+		return;
+	}
+	uint8_t pattern[sectorSize];
+	memset(pattern, 0xa5, sectorSize);
+	stats.blocksPreErased += preEraseEnd - rwSector;
+	for(; rwSector < preEraseEnd; ++rwSector) {
+		writeSectors(rwSector, pattern, 1);
+	}
+	preEraseEnd = 0;
+}
+
+void Emulator::erase()
+{
+	size_t count = eraseEnd - eraseStart + 1;
+	eraseSectors(eraseStart, count);
+	stats.blocksErased += count;
+	eraseStartSet = eraseEndSet = false;
+	setBusy(timing.eraseBusyUs + (uint64_t(count) * timing.eraseBlockBusyNs / 1000));
+}
+
+bool Emulator::addressToSector(uint32_t arg, uint32_t& sector) const
+{
+	if(kind == Kind::sdhc) {
+		sector = arg;
+		return true;
+	}
+	if(arg % sectorSize) {
+		return false;
+	}
+	sector = arg >> sectorSizeShift;
+	return true;
+}
+
+uint8_t Emulator::r1() const
+{
+	return (state == State::ready) ? 0 : R1_IDLE;
+}
+
+bool Emulator::isBusy() const
+{
+	return busyTime != 0 && (micros() - busyStart) < busyTime;
+}
+
+void Emulator::setBusy(uint32_t us)
+{
+	busyStart = micros();
+	busyTime = std::max(us, 1U);
+}
+
+void Emulator::checkClock(uint8_t cmd)
+{
+	// Identification must be done at 400kHz or less, otherwise limited by TRAN_SPEED
+	uint32_t maxFreq = (state != State::ready) ? 400000U : highSpeed ? 50000000U : 25000000U;
+	if(frequency > maxFreq) {
+		debug_w("[SDEMU] CMD%u clocked at %u Hz, maximum %u", cmd, frequency, maxFreq);
+		++stats.clockErrors;
+	}
+}
+
+void Emulator::buildCSD()
+{
+	memset(csd, 0, sizeof(csd));
+	auto set = [this](unsigned start, unsigned size, uint32_t value) { setBits(csd, sizeof(csd), start, size, value); };
+
+	set(112, 8, 0x0e);					 // TAAC: 1ms
+	set(96, 8, highSpeed ? 0x5a : 0x32); // TRAN_SPEED: 50MHz or 25MHz
+	set(84, 12, 0x5b5);
+	set(80, 4, 9); // READ_BL_LEN
+	set(46, 1, 1); // ERASE_BLK_EN
+	set(39, 7, 0x7f);
+	set(26, 3, 2); // R2W_FACTOR
+	set(22, 4, 9); // WRITE_BL_LEN
+	set(14, 1, 1); // COPY
+
+	if(kind == Kind::sdhc) {
+		set(126, 2, 1); // CSD_STRUCTURE v2
+		set(48, 22, (sectorCount >> 10) - 1);
+	} else {
+		// Capacity = (C_SIZE + 1) << (C_SIZE_MULT + 2) << READ_BL_LEN
+		unsigned mult = 0;
+		while((sectorCount >> (mult + 2)) > 4096 && mult < 7) {
+			++mult;
+		}
+		unsigned blLen = 9;
+		uint32_t blocks = sectorCount;
+		if((blocks >> (mult + 2)) > 4096) {
+			++blLen;
+			blocks >>= 1;
+		}
+		set(126, 2, 0); // CSD_STRUCTURE v1
+		set(80, 4, blLen);
+		set(62, 12, (blocks >> (mult + 2)) - 1);
+		set(47, 3, mult);
+		set(59, 3, 7); // VDD_R_CURR_MIN
+		set(56, 3, 6); // VDD_R_CURR_MAX
+		set(53, 3, 7); // VDD_W_CURR_MIN
+		set(50, 3, 6); // VDD_W_CURR_MAX
+	}
+
+	set(0, 1, 1);
+	set(1, 7, crc7(csd, 15));
+}
+
+void Emulator::buildCID()
+{
+	memset(cid, 0, sizeof(cid));
+	cid[0] = 0x00;								   // MID
+	memcpy(&cid[1], "SG", 2);					   // OID
+	memcpy(&cid[3], "SDEMU", 5);				   // PNM
+	cid[8] = 0x10;								   // PRV 1.0
+	cid[9] = 0x12, cid[10] = 0x34, cid[11] = 0x56; // PSN
+	cid[12] = 0x78;
+	cid[13] = 0x01; // MDT 2022/11
+	cid[14] = 0x6b;
+	cid[15] = (crc7(cid, 15) << 1) | 0x01;
+}
+
+void Emulator::buildSSR()
+{
+	memset(ssr, 0, sizeof(ssr));
+	auto set = [this](unsigned start, unsigned size, uint32_t value) { setBits(ssr, sizeof(ssr), start, size, value); };
+
+	set(440, 8, 4);							   // SPEED_CLASS: Class 10
+	set(428, 4, (kind == Kind::sdhc) ? 9 : 7); // AU_SIZE: 4MB or 1MB
+	set(408, 16, 1);						   // ERASE_SIZE: 1 AU
+	set(402, 6, 1);							   // ERASE_TIMEOUT: 1s
+	set(400, 2, 1);							   // ERASE_OFFSET: 1s
+	if(kind == Kind::sdhc) {
+		set(396, 4, 1);	 // UHS_SPEED_GRADE: U1
+		set(392, 4, 9);	 // UHS_AU_SIZE: 4MB
+		set(384, 8, 10); // VIDEO_SPEED_CLASS: V10
+	}
+}
+
+void Emulator::buildSCR()
+{
+	memset(scr, 0, sizeof(scr));
+	auto set = [this](unsigned start, unsigned size, uint32_t value) { setBits(scr, sizeof(scr), start, size, value); };
+
+	set(56, 4, (kind == Kind::sdv1) ? 0 : 2); // SD_SPEC: Version 1.0 or 2.00
+	set(48, 4, 0x05);						  // SD_BUS_WIDTHS: 1 and 4 bit
+	if(kind != Kind::sdv1) {
+		set(52, 3, (kind == Kind::sdhc) ? 3 : 2); // SD_SECURITY: SDHC or SDSC
+		set(47, 1, 1);							  // SD_SPEC3
+		set(32, 4, 0x02);						  // CMD_SUPPORT: CMD23
+	}
+}
+
+bool Emulator::readSectors(uint32_t sector, void* buffer, size_t count)
+{
+	size_t len = count << sectorSizeShift;
+	if(::lseek(fd, off_t(sector) << sectorSizeShift, SEEK_SET) < 0) {
+		return false;
+	}
+	auto res = ::read(fd, buffer, len);
+	if(res < 0) {
+		debug_e("[SDEMU] Read failed");
+		return false;
+	}
+	// File may be short if image was created elsewhere
+	memset(static_cast<uint8_t*>(buffer) + res, 0, len - res);
+	return true;
+}
+
+bool Emulator::writeSectors(uint32_t sector, const void* buffer, size_t count)
+{
+	size_t len = count << sectorSizeShift;
+	if(::lseek(fd, off_t(sector) << sectorSizeShift, SEEK_SET) < 0) {
+		return false;
+	}
+	if(::write(fd, buffer, len) != ssize_t(len)) {
+		debug_e("[SDEMU] Write failed");
+		return false;
+	}
+	return true;
+}
+
+bool Emulator::eraseSectors(uint32_t sector, size_t count)
+{
+#ifdef __linux__
+	// Release storage so image stays sparse
+	if(::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(sector) << sectorSizeShift,
+				   off_t(count) << sectorSizeShift) == 0) {
+		return true;
+	}
+#endif
+
+	uint8_t zeroes[sectorSize]{};
+	for(; count != 0; --count, ++sector) {
+		if(!writeSectors(sector, zeroes, 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace Storage::SD
+
+#endif // ARCH_HOST
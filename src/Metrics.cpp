@@ -0,0 +1,76 @@
+#include "include/Storage/SD/Metrics.h"
+
+#if SD_ENABLE_METRICS
+
+String toString(Storage::SD::Metrics::Command cmd)
+{
+	using Command = Storage::SD::Metrics::Command;
+
+	switch(cmd) {
+#define XX(tag, index)                                                                                                 \
+	case Command::tag:                                                                                                 \
+		return F(#tag);
+		SDCARD_METRICS_COMMAND_MAP(XX)
+#undef XX
+	case Command::other:
+		return F("other");
+	default:
+		return F("INVALID");
+	}
+}
+
+namespace Storage::SD
+{
+size_t Metrics::printTo(Print& p) const
+{
+	size_t n{0};
+
+#define FIELD(tag, value)                                                                                              \
+	n += p.print("  ");                                                                                                \
+	n += p.print(String(tag).pad(20));                                                                                 \
+	n += p.print(" : ");                                                                                               \
+	n += p.println(value);
+
+	FIELD(F("waitReadyUs"), waitReadyUs)
+	FIELD(F("tokenTimeouts"), tokenTimeouts)
+	FIELD(F("dataRejects"), dataRejects)
+	FIELD(F("bytesRead"), bytesRead)
+	FIELD(F("bytesWritten"), bytesWritten)
+	FIELD(F("cacheHits"), cacheHits)
+	FIELD(F("cacheMisses"), cacheMisses)
+	FIELD(F("cacheWriteBacks"), cacheWriteBacks)
+	FIELD(F("batchedCommands"), batchedCommands)
+	FIELD(F("mergedRequests"), mergedRequests)
+
+	// Upper bound of each histogram bucket
+	String s;
+	for(unsigned i = 0, limit = histogramBaseUs; i < histogramSize - 1; ++i, limit <<= 2) {
+		s += " <";
+		s += limit;
+	}
+	s += " >=";
+	s += histogramBaseUs << (2 * (histogramSize - 2));
+	FIELD(F("latency (us)"), s)
+
+	for(unsigned i = 0; i < unsigned(Command::MAX); ++i) {
+		auto& stats = commands[i];
+		if(stats.count == 0) {
+			continue;
+		}
+		s = stats.count;
+		s += ':';
+		for(auto count : stats.histogram) {
+			s += ' ';
+			s += count;
+		}
+		FIELD(toString(Command(i)), s)
+	}
+
+#undef FIELD
+
+	return n;
+}
+
+} // namespace Storage::SD
+
+#endif
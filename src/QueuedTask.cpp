@@ -0,0 +1,44 @@
+#include "include/Storage/SD/QueuedTask.h"
+#include <Platform/System.h>
+#include <new>
+
+namespace Storage::SD
+{
+bool QueuedTask::queue()
+{
+	if(token != nullptr) {
+		return true;
+	}
+	auto tok = new(std::nothrow) Token{this};
+	if(tok == nullptr) {
+		return false;
+	}
+	if(!System.queueCallback(handler, tok)) {
+		delete tok;
+		return false;
+	}
+	token = tok;
+	return true;
+}
+
+void QueuedTask::cancel()
+{
+	if(token != nullptr) {
+		token->task = nullptr;
+		token = nullptr;
+	}
+}
+
+void QueuedTask::handler(void* param)
+{
+	auto tok = static_cast<Token*>(param);
+	auto task = tok->task;
+	delete tok;
+	if(task == nullptr) {
+		return;
+	}
+	task->token = nullptr;
+	task->callback(task->param);
+}
+
+} // namespace Storage::SD
@@ -0,0 +1,239 @@
+#include "include/Storage/SD/RequestQueue.h"
+#include "include/Storage/SD/Card.h"
+#include <algorithm>
+
+namespace Storage::SD
+{
+namespace
+{
+bool overlaps(const RequestQueue::Request& a, const RequestQueue::Request& b)
+{
+	return a.next() < b.end() && b.next() < a.end();
+}
+
+} // namespace
+
+void RequestQueue::submit(const Request& request)
+{
+	queue.push_back(request);
+	schedule();
+}
+
+void RequestQueue::schedule()
+{
+	if(!queue.empty()) {
+		task.queue();
+	}
+}
+
+void RequestQueue::taskCallback(void* param)
+{
+	auto self = static_cast<RequestQueue*>(param);
+	self->service();
+	self->schedule();
+}
+
+/*
+ * A request must wait for any earlier request it overlaps, unless both are reads
+ */
+bool RequestQueue::isBlocked(size_t index) const
+{
+	auto& req = queue[index];
+	for(size_t i = 0; i < index; ++i) {
+		auto& other = queue[i];
+		if(req.kind == Kind::read && other.kind == Kind::read) {
+			continue;
+		}
+		if(overlaps(req, other)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Choose the next request to service
+ *
+ * Highest priority first, then the lowest sector at or above the current position,
+ * wrapping round to the lowest sector. The head of the queue is never blocked.
+ */
+size_t RequestQueue::select() const
+{
+	size_t best{0};
+	for(size_t i = 1; i < queue.size(); ++i) {
+		auto& req = queue[i];
+		auto& cur = queue[best];
+		if(req.priority > cur.priority || isBlocked(i)) {
+			continue;
+		}
+		if(req.priority < cur.priority) {
+			best = i;
+			continue;
+		}
+		bool ahead = req.next() >= position;
+		bool curAhead = cur.next() >= position;
+		if(ahead > curAhead || (ahead == curAhead && req.next() < cur.next())) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*
+ * Transfer next chunk of a request, together with any requests which follow on from it.
+ * Burst requests are transferred in one piece and not merged.
+ *
+ * Returns false if transfer failed, in which case all merged requests fail
+ */
+bool RequestQueue::transfer(size_t index)
+{
+	if(queue[index].burst) {
+		return transferBurst(queue[index]);
+	}
+
+	struct Member {
+		size_t index;
+		size_t count;
+	};
+	uint8_t* blocks[maxChunkSectors];
+	Member members[maxChunkSectors];
+	size_t memberCount{0};
+	const auto sectorSize = card.getSectorSize();
+	const auto kind = queue[index].kind;
+	const auto start = queue[index].next();
+	size_t count{0};
+
+	while(true) {
+		auto& req = queue[index];
+		auto n = std::min(req.count - req.done, maxChunkSectors - count);
+		for(size_t i = 0; i < n; ++i) {
+			blocks[count + i] = req.buffer + (req.done + i) * sectorSize;
+		}
+		members[memberCount++] = {index, n};
+		count += n;
+		if(count == maxChunkSectors) {
+			break;
+		}
+
+		// Find a request which continues from here
+		auto it = std::find_if(queue.begin(), queue.end(), [&](const Request& r) {
+			return r.kind == kind && !r.burst && r.next() == start + count && r.done < r.count;
+		});
+		if(it == queue.end() || isBlocked(it - queue.begin())) {
+			break;
+		}
+		index = it - queue.begin();
+	}
+
+	bool ok = (kind == Kind::read) ? card.read_blocks(start, MutableBlockList(blocks), count)
+								   : card.write_blocks(start, BlockList(blocks), count);
+	SD_METRICS(card.metrics.mergedRequests += memberCount - 1;)
+
+	for(size_t i = 0; i < memberCount; ++i) {
+		auto& req = queue[members[i].index];
+		req.done += members[i].count;
+		req.failed |= !ok;
+	}
+	position = start + count;
+	return ok;
+}
+
+bool RequestQueue::transferBurst(Request& req)
+{
+	const auto sectorSize = card.getSectorSize();
+	const auto start = req.next();
+	const auto count = req.count - req.done;
+	auto data = req.buffer + req.done * sectorSize;
+	bool ok = (req.kind == Kind::read) ? card.read_blocks(start, {data, uint16_t(sectorSize)}, count)
+									   : card.write_blocks(start, {data, uint16_t(sectorSize)}, count);
+	req.done = req.count;
+	req.failed |= !ok;
+	position = start + count;
+	return ok;
+}
+
+/*
+ * Erase next part of a discard request
+ *
+ * Whole erase units are erased one per call, so a large discard doesn't hold up other requests.
+ * Sectors at either end which don't fill a unit are handled according to the discard policy.
+ */
+bool RequestQueue::discard(Request& req)
+{
+	const auto sectorSize = card.getSectorSize();
+	const storage_size_t unitSectors = std::max(card.getBlockSize() / sectorSize, size_t(1));
+	const auto start = req.next();
+	auto n = std::min(storage_size_t(req.count - req.done), unitSectors - start % unitSectors);
+
+	bool ok{true};
+	if(n == unitSectors) {
+		ok = card.raw_sector_erase_range(start, n);
+	} else if(discardPolicy == DiscardPolicy::write) {
+		n = std::min(n, storage_size_t(maxChunkSectors));
+		if(!fillBlock) {
+			fillBlock.reset(new(std::nothrow) uint8_t[sectorSize]);
+		}
+		ok = bool(fillBlock);
+		if(ok) {
+			memset(fillBlock.get(), card.scr.data_stat_after_erase() ? 0xff : 0x00, sectorSize);
+			ok = card.write_blocks(start, {fillBlock.get(), 0}, n);
+		}
+	}
+
+	req.done += n;
+	req.failed |= !ok;
+	position = start + n;
+	return ok;
+}
+
+/*
+ * Service next chunk of the selected request
+ *
+ * Returns false if request failed
+ */
+bool RequestQueue::service()
+{
+	if(queue.empty()) {
+		return true;
+	}
+
+	auto index = select();
+	auto& req = queue[index];
+	bool ok = (req.kind == Kind::erase) ? discard(req) : transfer(index);
+
+	// Remove completed requests before invoking callbacks as they may submit others
+	struct Completion {
+		Callback callback;
+		bool success;
+	};
+	Completion completed[maxChunkSectors];
+	size_t completedCount{0};
+	for(auto it = queue.begin(); it != queue.end();) {
+		if(it->failed || it->done == it->count) {
+			completed[completedCount++] = {it->callback, !it->failed};
+			it = queue.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	for(size_t i = 0; i < completedCount; ++i) {
+		auto& c = completed[i];
+		if(c.callback) {
+			c.callback(c.success);
+		}
+	}
+	return ok;
+}
+
+bool RequestQueue::flush()
+{
+	bool res{true};
+	while(!queue.empty()) {
+		res &= service();
+	}
+	task.cancel();
+	return res;
+}
+
+} // namespace Storage::SD
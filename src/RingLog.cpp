@@ -0,0 +1,291 @@
+#include "include/Storage/SD/RingLog.h"
+#include <debug_progmem.h>
+#include <algorithm>
+
+namespace Storage::SD
+{
+namespace
+{
+/*
+ * Find last index for which predicate is true, given that it holds for index 0
+ * and for no index after the first which fails
+ */
+template <typename Predicate> uint32_t findLast(uint32_t count, Predicate pred)
+{
+	uint32_t lo{0};
+	uint32_t hi{count};
+	while(hi - lo > 1) {
+		auto mid = lo + (hi - lo) / 2;
+		if(pred(mid)) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+} // namespace
+
+bool RingLog::init()
+{
+	auto device = partition.getDevice();
+	if(device == nullptr || device->getType() != Device::Type::sdcard) {
+		debug_e("[SD] RingLog requires a card partition");
+		return false;
+	}
+
+	card = static_cast<Card*>(device);
+	sectorSize = card->getSectorSize();
+	auto unitSize = card->getBlockSize();
+	if(partition.address() % unitSize != 0 || partition.size() % unitSize != 0 || partition.size() < 2 * unitSize) {
+		debug_e("[SD] RingLog partition must be aligned to, and at least two, allocation units");
+		return false;
+	}
+
+	unitSectors = unitSize / sectorSize;
+	sectorCount = partition.size() / sectorSize;
+	return true;
+}
+
+bool RingLog::format()
+{
+	end();
+	if(!init()) {
+		return false;
+	}
+	head = tail = 0;
+
+	// Discarded sectors may keep their contents, so overwrite every record header
+	const size_t chunkSectors = std::min<uint32_t>(unitSectors, 16);
+	std::unique_ptr<uint8_t[]> zeroes(new(std::nothrow) uint8_t[chunkSectors * sectorSize]{});
+	if(!zeroes) {
+		return false;
+	}
+	for(uint32_t pos = 0; pos < sectorCount; pos += chunkSectors) {
+		if(!partition.write(storage_size_t(pos) * sectorSize, zeroes.get(), chunkSectors * sectorSize)) {
+			return false;
+		}
+	}
+	return card->sync();
+}
+
+bool RingLog::begin(size_t bufferSectors)
+{
+	end();
+	if(bufferSectors == 0 || !init()) {
+		return false;
+	}
+
+	this->bufferSectors = bufferSectors;
+	buffer.reset(new(std::nothrow) uint8_t[(2 * bufferSectors + 1) * sectorSize]);
+	if(!buffer) {
+		return false;
+	}
+
+	if(!recover()) {
+		buffer.reset();
+		return false;
+	}
+
+	// Unit following a partially written one should already be erased, but may not be after a reset
+	if(head % unitSectors != 0 && !preErase(head)) {
+		buffer.reset();
+		return false;
+	}
+
+	debug_i("[SD] RingLog tail %llu, head %llu", tail, head);
+	return true;
+}
+
+void RingLog::end()
+{
+	if(!buffer) {
+		return;
+	}
+	flush();
+	buffer.reset();
+	active = 0;
+	activeCount = 0;
+}
+
+/*
+ * Read header of record stored at given position
+ *
+ * Returns false if sector does not contain a valid record for that position
+ */
+bool RingLog::readHeader(uint32_t pos, Header& header)
+{
+	auto sector = getScratch();
+	if(!partition.read(storage_size_t(pos) * sectorSize, sector, sectorSize)) {
+		readError = true;
+		return false;
+	}
+	memcpy(&header, sector, sizeof(header));
+	return header.magic == headerMagic && header.sequence % sectorCount == pos && header.length <= getMaxRecordSize();
+}
+
+/*
+ * Find newest record by binary search
+ *
+ * Records written since the log last wrapped form a prefix of the partition, followed by
+ * an erased gap then older records. Comparing each unit's first record against that of unit 0
+ * locates the newest unit, then the same test on its sectors locates the newest record.
+ *
+ * If unit 0 is erased then either the log is empty or the writer is in the final unit.
+ */
+bool RingLog::recover()
+{
+	head = tail = 0;
+	readError = false;
+	const auto units = sectorCount / unitSectors;
+	Header header;
+
+	auto getLap = [&]() { return header.sequence / sectorCount; };
+	uint32_t unit;
+	if(readHeader(0, header)) {
+		auto lap = getLap();
+		unit = findLast(units, [&](uint32_t u) { return readHeader(u * unitSectors, header) && getLap() == lap; });
+	} else if(readHeader((units - 1) * unitSectors, header)) {
+		unit = units - 1;
+	} else {
+		return !readError;
+	}
+
+	const auto first = unit * unitSectors;
+	readHeader(first, header);
+	auto lap = getLap();
+	auto index = findLast(unitSectors, [&](uint32_t i) { return readHeader(first + i, header) && getLap() == lap; });
+	readHeader(first + index, header);
+	head = header.sequence + 1;
+
+	// Following unit has been erased
+	auto start = header.sequence - index;
+	if(start + 2 * unitSectors > sectorCount) {
+		tail = start + 2 * unitSectors - sectorCount;
+	}
+
+	return !readError;
+}
+
+/*
+ * Discard unit following the one containing a record
+ */
+bool RingLog::preErase(uint64_t sequence)
+{
+	auto start = sequence - sequence % unitSectors;
+	uint32_t next = (start + unitSectors) % sectorCount;
+	if(!card->submitDiscard(partition.address() + storage_size_t(next) * sectorSize,
+							storage_size_t(unitSectors) * sectorSize, nullptr)) {
+		debug_e("[SD] RingLog pre-erase failed");
+		return false;
+	}
+
+	// Records from previous lap in that unit are lost
+	if(start + 2 * unitSectors > sectorCount) {
+		tail = std::max(tail, start + 2 * unitSectors - sectorCount);
+	}
+	return true;
+}
+
+bool RingLog::append(const void* data, size_t length)
+{
+	if(!buffer || length > getMaxRecordSize()) {
+		return false;
+	}
+
+	// Each burst must be contiguous and within a single unit
+	if(head % unitSectors == 0 && !(submit() && preErase(head))) {
+		return false;
+	}
+
+	if(activeCount == 0) {
+		// Wait for this buffer's previous write, leaving any discard queued
+		while(busy[active]) {
+			if(!card->serviceRequests()) {
+				return false;
+			}
+		}
+		bufferStart[active] = head;
+	}
+
+	auto sector = getBuffer(active) + activeCount * sectorSize;
+	Header header{headerMagic, uint16_t(length), 0, head};
+	memcpy(sector, &header, sizeof(header));
+	memcpy(sector + sizeof(header), data, length);
+	memset(sector + sizeof(header) + length, 0, getMaxRecordSize() - length);
+	++activeCount;
+	++head;
+
+	if(activeCount == bufferSectors) {
+		return submit();
+	}
+	return true;
+}
+
+/*
+ * Queue active buffer for writing and switch to the other one
+ */
+bool RingLog::submit()
+{
+	if(activeCount == 0) {
+		return true;
+	}
+
+	const auto index = active;
+	auto address = partition.address() + storage_size_t(bufferStart[index] % sectorCount) * sectorSize;
+	Card::Callback callback = [this, index](bool success) {
+		busy[index] = false;
+		writeError |= !success;
+	};
+	busy[index] = card->submitBurst(address, getBuffer(index), activeCount * sectorSize, callback);
+	if(!busy[index]) {
+		return false;
+	}
+
+	active ^= 1;
+	activeCount = 0;
+	return true;
+}
+
+bool RingLog::flush()
+{
+	if(!buffer) {
+		return false;
+	}
+	bool res = submit() && card->sync() && !writeError;
+	writeError = false;
+	return res;
+}
+
+/*
+ * Get sequence number of first record not yet written to the card
+ */
+uint64_t RingLog::getWritten() const
+{
+	auto written = head;
+	for(unsigned i = 0; i < 2; ++i) {
+		if(busy[i] || (i == active && activeCount != 0)) {
+			written = std::min(written, bufferStart[i]);
+		}
+	}
+	return written;
+}
+
+bool RingLog::read(uint64_t sequence, void* data, size_t& length)
+{
+	if(!buffer || sequence < tail || sequence >= getWritten()) {
+		return false;
+	}
+
+	Header header;
+	if(!readHeader(sequence % sectorCount, header) || header.sequence != sequence) {
+		return false;
+	}
+
+	memcpy(data, getScratch() + sizeof(header), header.length);
+	length = header.length;
+	return true;
+}
+
+} // namespace Storage::SD
@@ -0,0 +1,24 @@
+#include "include/Storage/SD/SCR.h"
+
+namespace Storage::SD
+{
+size_t SCR::printTo(Print& p) const
+{
+	size_t n{0};
+
+#define FIELD(tag, value)                                                                                              \
+	n += p.print("  ");                                                                                                \
+	n += p.print(F(tag).pad(20));                                                                                      \
+	n += p.print(" : ");                                                                                               \
+	n += p.println(value);
+
+#define XX(tag, ...) FIELD(#tag, tag())
+
+	SDCARD_SCR_MAP(XX)
+
+#undef XX
+
+	return n;
+}
+
+} // namespace Storage::SD
@@ -0,0 +1,59 @@
+#include "include/Storage/SD/SSR.h"
+
+namespace Storage::SD
+{
+uint32_t SSR::getAllocationUnitSize() const
+{
+	// 16KB doubling up to 4MB, then irregular steps
+	static const uint8_t largeSizes[]{8, 12, 16, 24, 32, 64};
+
+	auto n = au_size();
+	if(n == 0) {
+		return 0;
+	}
+	if(n <= 9) {
+		return 0x4000U << (n - 1);
+	}
+	return uint32_t(largeSizes[n - 10]) << 20;
+}
+
+uint8_t SSR::getSpeedClass() const
+{
+	static const uint8_t classes[]{0, 2, 4, 6, 10};
+
+	auto n = speed_class();
+	return (n < ARRAY_SIZE(classes)) ? classes[n] : 0;
+}
+
+uint32_t SSR::getEraseTimeout(uint32_t units) const
+{
+	// ERASE_TIMEOUT seconds for each ERASE_SIZE units, plus ERASE_OFFSET seconds
+	if(erase_size() == 0 || erase_timeout() == 0) {
+		return 0;
+	}
+	return (uint64_t(erase_timeout()) * units * 1000 / erase_size()) + (erase_offset() * 1000U);
+}
+
+size_t SSR::printTo(Print& p) const
+{
+	size_t n{0};
+
+#define FIELD(tag, value)                                                                                              \
+	n += p.print("  ");                                                                                                \
+	n += p.print(F(tag).pad(20));                                                                                      \
+	n += p.print(" : ");                                                                                               \
+	n += p.println(value);
+
+#define XX(tag, ...) FIELD(#tag, tag())
+
+	SDCARD_SSR_MAP(XX)
+	FIELD("AU size", getAllocationUnitSize())
+	FIELD("speed class", getSpeedClass())
+	FIELD("AU erase time (ms)", getEraseTimeout(1))
+
+#undef XX
+
+	return n;
+}
+
+} // namespace Storage::SD
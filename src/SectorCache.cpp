@@ -0,0 +1,287 @@
+#include "include/Storage/SD/SectorCache.h"
+#include "include/Storage/SD/Card.h"
+#include <debug_progmem.h>
+
+namespace Storage::SD
+{
+bool SectorCache::setCapacity(size_t sectors)
+{
+	entries.reset();
+	buffer.reset();
+	capacity = 0;
+	useCounter = 0;
+	if(sectors == 0) {
+		return true;
+	}
+
+	entries.reset(new(std::nothrow) Entry[sectors]{});
+	buffer.reset(new(std::nothrow) uint8_t[sectors * card.getSectorSize()]);
+	if(!entries || !buffer) {
+		debug_e("[SD] Cache allocation failed");
+		entries.reset();
+		buffer.reset();
+		return false;
+	}
+
+	capacity = sectors;
+	return true;
+}
+
+size_t SectorCache::getDirtyCount() const
+{
+	size_t count{0};
+	for(size_t i = 0; i < capacity; ++i) {
+		count += entries[i].dirty;
+	}
+	return count;
+}
+
+size_t SectorCache::getFreeCount() const
+{
+	size_t count{0};
+	for(size_t i = 0; i < capacity; ++i) {
+		count += !entries[i].pinned;
+	}
+	return count;
+}
+
+SectorCache::Entry* SectorCache::find(storage_size_t sector)
+{
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(entry.valid && entry.sector == sector) {
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+/*
+ * Get an entry for a new sector, evicting the least recently used one if necessary.
+ * Returns nullptr if all entries are pinned.
+ */
+SectorCache::Entry* SectorCache::allocate(storage_size_t sector)
+{
+	Entry* victim{nullptr};
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(entry.pinned) {
+			continue;
+		}
+		if(!entry.valid) {
+			victim = &entry;
+			break;
+		}
+		if(victim == nullptr || entry.lastUse < victim->lastUse) {
+			victim = &entry;
+		}
+	}
+
+	if(victim == nullptr) {
+		return nullptr;
+	}
+
+	// Write back everything so subsequent evictions are cheap
+	if(victim->dirty && !flush()) {
+		return nullptr;
+	}
+
+	*victim = Entry{sector, ++useCounter, true, false, false, false};
+	return victim;
+}
+
+uint8_t* SectorCache::getData(const Entry& entry)
+{
+	return buffer.get() + (&entry - entries.get()) * card.getSectorSize();
+}
+
+bool SectorCache::read(storage_size_t sector, const MutableBlockList& blocks, size_t count)
+{
+	const auto sectorSize = card.getSectorSize();
+
+	if(count == 1) {
+		auto entry = find(sector);
+		if(entry != nullptr && entry->loaded) {
+			SD_METRICS(++card.metrics.cacheHits;)
+			entry->lastUse = ++useCounter;
+			memcpy(blocks[0], getData(*entry), sectorSize);
+			return true;
+		}
+
+		SD_METRICS(++card.metrics.cacheMisses;)
+		if(entry == nullptr) {
+			entry = allocate(sector);
+		}
+		if(entry == nullptr) {
+			return card.read_sectors(sector, blocks, 1);
+		}
+		auto data = getData(*entry);
+		if(!card.read_sectors(sector, {data, sectorSize}, 1)) {
+			entry->valid = entry->pinned;
+			return false;
+		}
+		entry->loaded = true;
+		memcpy(blocks[0], data, sectorSize);
+		return true;
+	}
+
+	// Larger reads go directly to the card, then we overlay any modified sectors
+	if(!card.read_sectors(sector, blocks, count)) {
+		return false;
+	}
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(!entry.contains(sector, count)) {
+			continue;
+		}
+		auto src = blocks[entry.sector - sector];
+		if(entry.dirty) {
+			memcpy(src, getData(entry), sectorSize);
+		} else if(!entry.loaded) {
+			// Pinned sector can be loaded for free
+			memcpy(getData(entry), src, sectorSize);
+			entry.loaded = true;
+		}
+	}
+	return true;
+}
+
+bool SectorCache::write(storage_size_t sector, const BlockList& blocks, size_t count)
+{
+	const auto sectorSize = card.getSectorSize();
+
+	if(count == 1) {
+		auto entry = find(sector);
+		if(entry != nullptr) {
+			SD_METRICS(++card.metrics.cacheHits;)
+		} else {
+			SD_METRICS(++card.metrics.cacheMisses;)
+			entry = allocate(sector);
+			if(entry == nullptr) {
+				return card.write_sectors(sector, blocks, 1);
+			}
+		}
+		memcpy(getData(*entry), blocks[0], sectorSize);
+		entry->lastUse = ++useCounter;
+		entry->loaded = true;
+		entry->dirty = true;
+		return true;
+	}
+
+	// Larger writes go directly to the card, updating any cached copies
+	if(!card.write_sectors(sector, blocks, count)) {
+		return false;
+	}
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(entry.contains(sector, count)) {
+			memcpy(getData(entry), blocks[entry.sector - sector], sectorSize);
+			entry.loaded = true;
+			entry.dirty = false;
+		}
+	}
+	return true;
+}
+
+bool SectorCache::pin(storage_size_t sector, size_t count)
+{
+	size_t required{0};
+	for(size_t i = 0; i < count; ++i) {
+		auto entry = find(sector + i);
+		required += (entry == nullptr || !entry->pinned);
+	}
+	if(required >= getFreeCount()) {
+		// Always leave at least one entry for general use
+		return false;
+	}
+
+	// Entries pinned by this call, so they can be released if allocation fails
+	std::unique_ptr<Entry*[]> pinned(new(std::nothrow) Entry*[required]);
+	if(required != 0 && !pinned) {
+		return false;
+	}
+	size_t pinCount{0};
+
+	for(size_t i = 0; i < count; ++i) {
+		auto entry = find(sector + i);
+		if(entry == nullptr) {
+			entry = allocate(sector + i);
+			if(entry == nullptr) {
+				// Write-back of an evicted sector failed
+				for(size_t j = 0; j < pinCount; ++j) {
+					pinned[j]->pinned = false;
+					pinned[j]->valid = pinned[j]->loaded;
+				}
+				return false;
+			}
+		}
+		if(!entry->pinned) {
+			entry->pinned = true;
+			pinned[pinCount++] = entry;
+		}
+	}
+	return true;
+}
+
+void SectorCache::unpin(storage_size_t sector, size_t count)
+{
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(entry.contains(sector, count)) {
+			entry.pinned = false;
+			entry.valid = entry.loaded;
+		}
+	}
+}
+
+void SectorCache::invalidate(storage_size_t sector, size_t count)
+{
+	for(size_t i = 0; i < capacity; ++i) {
+		auto& entry = entries[i];
+		if(entry.contains(sector, count)) {
+			entry.valid = entry.pinned;
+			entry.loaded = false;
+			entry.dirty = false;
+		}
+	}
+}
+
+/*
+ * Write dirty sectors in ascending order, using multiple block writes for contiguous runs
+ */
+bool SectorCache::flush()
+{
+	static constexpr size_t maxRunSectors{16};
+	const uint8_t* blocks[maxRunSectors];
+
+	for(;;) {
+		Entry* first{nullptr};
+		for(size_t i = 0; i < capacity; ++i) {
+			auto& entry = entries[i];
+			if(entry.dirty && (first == nullptr || entry.sector < first->sector)) {
+				first = &entry;
+			}
+		}
+		if(first == nullptr) {
+			return true;
+		}
+
+		auto sector = first->sector;
+		size_t count{0};
+		for(Entry* entry = first; entry != nullptr && entry->dirty && count < maxRunSectors;
+			entry = find(sector + count)) {
+			blocks[count++] = getData(*entry);
+		}
+
+		if(!card.write_sectors(sector, blocks, count, true)) {
+			return false;
+		}
+
+		for(size_t i = 0; i < count; ++i) {
+			find(sector + i)->dirty = false;
+		}
+		SD_METRICS(card.metrics.cacheWriteBacks += count;)
+	}
+}
+
+} // namespace Storage::SD
@@ -0,0 +1,65 @@
+#include "include/Storage/SD/SpiBus.h"
+#include <debug_progmem.h>
+
+namespace Storage::SD
+{
+bool SpiBus::attach()
+{
+	if(clientCount == 0 && !spi.begin()) {
+		debug_e("[SD] SPI init failed");
+		return false;
+	}
+	++clientCount;
+	return true;
+}
+
+void SpiBus::detach(Client& client)
+{
+	release(client);
+	if(configured == &client) {
+		configured = nullptr;
+	}
+	if(clientCount == 0) {
+		return;
+	}
+	--clientCount;
+	if(clientCount == 0) {
+		spi.end();
+	}
+}
+
+bool SpiBus::acquire(Client& client, SPISettings& settings)
+{
+	if(owner != nullptr && owner != &client) {
+		// Owner must release the bus from within this call
+		if(!owner->yieldBus() || owner != nullptr) {
+			return false;
+		}
+	}
+
+	owner = &client;
+	if(configured != &client) {
+		spi.beginTransaction(settings);
+		configured = &client;
+	}
+	return true;
+}
+
+void SpiBus::release(Client& client)
+{
+	if(owner == &client) {
+		owner = nullptr;
+	}
+}
+
+void SpiBus::update(Client& client, SPISettings& settings)
+{
+	if(owner == &client) {
+		spi.beginTransaction(settings);
+		configured = &client;
+	} else if(configured == &client) {
+		configured = nullptr;
+	}
+}
+
+} // namespace Storage::SD
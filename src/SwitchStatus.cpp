@@ -0,0 +1,22 @@
+#include "include/Storage/SD/SwitchStatus.h"
+
+namespace Storage::SD
+{
+size_t SwitchStatus::printTo(Print& p) const
+{
+	size_t n{0};
+
+#define XX(tag, ...)                                                                                                   \
+	n += p.print("  ");                                                                                                \
+	n += p.print(F(#tag).pad(20));                                                                                     \
+	n += p.print(" : 0x");                                                                                             \
+	n += p.println(tag(), HEX);
+
+	SDCARD_SWITCH_STATUS_MAP(XX)
+
+#undef XX
+
+	return n;
+}
+
+} // namespace Storage::SD
@@ -0,0 +1,206 @@
+#include "include/Storage/SD/Worker.h"
+
+#if defined(ARCH_ESP32) || defined(ARCH_HOST)
+
+#include <algorithm>
+
+namespace Storage::SD
+{
+bool Worker::start()
+{
+	if(running) {
+		return true;
+	}
+	if(!card.initialised) {
+		return false;
+	}
+
+	// Card is only accessed from the worker thread, so complete or cancel anything due to run from the task queue
+	card.requests.flush();
+	card.end_session();
+	card.readAhead.task.cancel();
+	card.workerActive = true;
+
+	stopping = false;
+	running = true;
+	thread = std::thread(&Worker::run, this);
+	return true;
+}
+
+void Worker::stop()
+{
+	if(!running) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	workReady.notify_one();
+	thread.join();
+	running = false;
+
+	// No session timeout was set whilst worker was running
+	card.end_session();
+	card.workerActive = false;
+}
+
+bool Worker::read(storage_size_t address, void* dst, size_t size)
+{
+	return execute(Kind::read, address, dst, size);
+}
+
+bool Worker::write(storage_size_t address, const void* src, size_t size)
+{
+	return execute(Kind::write, address, const_cast<void*>(src), size);
+}
+
+bool Worker::erase_range(storage_size_t address, storage_size_t size)
+{
+	return execute(Kind::erase, address, nullptr, size);
+}
+
+bool Worker::sync()
+{
+	return execute(Kind::sync, 0, nullptr, 0);
+}
+
+/*
+ * Queue request and wait for it to complete
+ */
+bool Worker::execute(Kind kind, storage_size_t address, void* buffer, storage_size_t size)
+{
+	if(!running || stopping) {
+		return false;
+	}
+
+	Request req{kind, address, size, buffer, false, false};
+	if(!queue.push(&req)) {
+		std::unique_lock<std::mutex> lock(mutex);
+		spaceReady.wait(lock, [&]() { return queue.push(&req); });
+	}
+
+	// Taking the lock ensures worker is either waiting, or will see the request before it does
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+	}
+	workReady.notify_one();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	requestsDone.wait(lock, [&]() { return req.done; });
+	return req.success;
+}
+
+void Worker::run()
+{
+	Request* batch[queueSize];
+	for(;;) {
+		size_t count{0};
+		while(count < queueSize && queue.pop(batch[count])) {
+			++count;
+		}
+
+		if(count == 0) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if(stopping && queue.empty()) {
+				break;
+			}
+			workReady.wait(lock, [this]() { return stopping || !queue.empty(); });
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		spaceReady.notify_all();
+
+		process(batch, count);
+	}
+}
+
+/*
+ * Sort batch by address so contiguous transfers can be merged, with any sync requests last
+ */
+void Worker::process(Request** batch, size_t count)
+{
+	std::sort(batch, batch + count, [](const Request* a, const Request* b) {
+		return (a->kind == b->kind) ? a->address < b->address : a->kind < b->kind;
+	});
+
+	for(size_t i = 0; i < count;) {
+		auto& req = *batch[i];
+		switch(req.kind) {
+		case Kind::read:
+		case Kind::write:
+			i += transfer(&batch[i], count - i);
+			break;
+		case Kind::erase:
+			complete(req, card.erase_range(req.address, req.size));
+			++i;
+			break;
+		case Kind::sync:
+			complete(req, card.sync());
+			++i;
+			break;
+		}
+	}
+
+	requestsDone.notify_all();
+}
+
+/*
+ * Perform first transfer in batch, merged with any which follow on from it
+ *
+ * Returns number of requests completed
+ */
+size_t Worker::transfer(Request** batch, size_t count)
+{
+	const auto sectorSize = card.getSectorSize();
+	auto isAligned = [&](const Request& req) { return ((req.address | req.size) & (sectorSize - 1)) == 0; };
+
+	auto& first = *batch[0];
+	size_t n{1};
+	if(isAligned(first)) {
+		auto end = first.address + first.size;
+		while(n < count && batch[n]->kind == first.kind && batch[n]->address == end && isAligned(*batch[n])) {
+			end += batch[n]->size;
+			++n;
+		}
+	}
+
+	bool success;
+	if(n == 1) {
+		success = (first.kind == Kind::read) ? card.read(first.address, first.buffer, first.size)
+											 : card.write(first.address, first.buffer, first.size);
+	} else if(first.kind == Kind::read) {
+		MutableSegment segments[queueSize];
+		for(size_t i = 0; i < n; ++i) {
+			segments[i] = {batch[i]->buffer, size_t(batch[i]->size)};
+		}
+		success = card.readv(first.address, segments, n);
+	} else {
+		Segment segments[queueSize];
+		for(size_t i = 0; i < n; ++i) {
+			segments[i] = {batch[i]->buffer, size_t(batch[i]->size)};
+		}
+		success = card.writev(first.address, segments, n);
+	}
+	SD_METRICS(card.metrics.mergedRequests += n - 1;)
+
+	for(size_t i = 0; i < n; ++i) {
+		complete(*batch[i], success);
+	}
+	return n;
+}
+
+void Worker::complete(Request& req, bool success)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	req.success = success;
+	req.done = true;
+}
+
+} // namespace Storage::SD
+
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+namespace Storage::SD
+{
+/**
+ * @brief Buffer for a scatter-gather transfer
+ *
+ * Size must be a non-zero multiple of the sector size.
+ */
+template <typename T> struct SegmentT {
+	T* data;
+	size_t size;
+};
+
+using Segment = SegmentT<const void>;  ///< Source of data for writing
+using MutableSegment = SegmentT<void>; ///< Destination for data being read
+
+/**
+ * @brief Sector buffers for a transfer
+ *
+ * Sectors may be contiguous, a list of separate blocks, or a list of segments each
+ * containing one or more contiguous sectors.
+ *
+ * A stride of 0 repeats the same block, e.g. to fill sectors with a fixed pattern.
+ */
+template <typename T> struct BlockListT {
+	using VoidType = std::conditional_t<std::is_const_v<T>, const void, void>;
+	using SegmentType = SegmentT<VoidType>;
+
+	BlockListT(VoidType* data, uint16_t stride) : data(static_cast<T*>(data)), stride(stride)
+	{
+	}
+
+	BlockListT(T* const* blocks) : blocks(blocks)
+	{
+	}
+
+	BlockListT(const SegmentType* segments, uint16_t sectorSize) : segments(segments), stride(sectorSize)
+	{
+	}
+
+	T* operator[](size_t index) const
+	{
+		if(blocks) {
+			return blocks[index];
+		}
+		if(segments) {
+			index += first;
+			for(auto seg = segments;; ++seg) {
+				auto n = seg->size / stride;
+				if(index < n) {
+					return static_cast<T*>(seg->data) + index * stride;
+				}
+				index -= n;
+			}
+		}
+		return data + index * stride;
+	}
+
+	/**
+	 * @brief Get list starting at a later block
+	 */
+	BlockListT operator+(size_t index) const
+	{
+		auto list = *this;
+		if(blocks) {
+			list.blocks += index;
+		} else if(segments) {
+			list.first += index;
+		} else {
+			list.data += index * stride;
+		}
+		return list;
+	}
+
+	T* data{nullptr};
+	T* const* blocks{nullptr};
+	const SegmentType* segments{nullptr};
+	size_t first{0}; ///< Index of first block in segments
+	uint16_t stride{0};
+};
+
+using BlockList = BlockListT<const uint8_t>;  ///< Source of data for writing
+using MutableBlockList = BlockListT<uint8_t>; ///< Destination for data being read
+
+} // namespace Storage::SD
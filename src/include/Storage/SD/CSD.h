@@ -123,6 +123,19 @@ struct CSD {
 
 	uint64_t getSize() const;
 
+	/**
+	 * @brief Get maximum data transfer rate decoded from TRAN_SPEED
+	 * @retval uint32_t Bits per second (i.e. SPI clock frequency), 0 if field is invalid
+	 */
+	uint32_t getTransferRate() const;
+
+	/**
+	 * @brief Get typical read access time decoded from TAAC and NSAC
+	 * @param clock SPI clock frequency in Hz, for the NSAC component
+	 * @retval uint32_t Nanoseconds
+	 */
+	uint32_t getAccessTime(uint32_t clock) const;
+
 	SDCARD_CSD_MAP_C(XX)
 
 	size_t printTo(Print& p) const;
@@ -8,13 +8,26 @@ Descr: Low-level SDCard functions
 #pragma once
 
 #include <Storage/Disk/BlockDevice.h>
-#include <SPIBase.h>
+#include <SimpleTimer.h>
+#include <memory>
+#include "SpiBus.h"
+#include "RequestQueue.h"
 #include "CSD.h"
 #include "CID.h"
+#include "SSR.h"
+#include "SCR.h"
+#include "SwitchStatus.h"
+#include "Metrics.h"
+#include "SectorCache.h"
+
+// Set to 0 for builds which only need to support block-addressed (SDHC/SDXC) cards
+#ifndef SD_ENABLE_BYTE_ADDRESSING
+#define SD_ENABLE_BYTE_ADDRESSING 1
+#endif
 
 namespace Storage::SD
 {
-class Card : public Disk::BlockDevice
+class Card : public Disk::BlockDevice, private SpiBus::Client
 {
 public:
 	/*
@@ -22,8 +35,46 @@ public:
 	 * and require transfers to be aligned to, and in multiples of, 512 bytes.
 	 */
 
-	Card(const String& name, SPIBase& spi) : BlockDevice(), name(name), spi(spi)
+	using Callback = RequestQueue::Callback;
+	using Priority = RequestQueue::Priority;
+	using DiscardPolicy = RequestQueue::DiscardPolicy;
+
+	/**
+	 * @brief Receives each block of a streaming read
+	 * @param block Sector data, only valid for the duration of the call
+	 * @param size Sector size
+	 * @retval bool Return false to abort the read
+	 */
+	using BlockCallback = Delegate<bool(const uint8_t* block, size_t size)>;
+	using AccessMode = SwitchStatus::AccessMode;
+
+	/**
+	 * @brief Construct a card which shares an SPI controller with other devices
+	 *
+	 * The bus is acquired for each transaction using this card's clock settings.
+	 */
+	Card(const String& name, SpiBus& bus)
+		: BlockDevice(), name(name), bus(bus), spi(bus.getController()), spiExt(bus.getControllerExt()),
+		  requests(*this)
+	{
+	}
+
+	/**
+	 * @brief Construct a card with sole use of an SPI controller
+	 */
+	Card(const String& name, SPIBase& spi) : Card(name, *new SpiBus(spi))
+	{
+		ownBus.reset(&bus);
+	}
+
+	/**
+	 * @brief Construct a card using an SPI controller with extended capabilities
+	 *
+	 * Data blocks are transferred directly to or from the caller's buffer.
+	 */
+	Card(const String& name, SPIExt& spi) : Card(name, *new SpiBus(spi))
 	{
+		ownBus.reset(&bus);
 	}
 
 	~Card()
@@ -34,12 +85,316 @@ public:
 	/**
 	 * @brief Initialise the card
 	 * @param chipSelect
-	 * @param freq SPI frequency in Hz, use 0 for maximum supported frequency
+	 * @param freq Maximum SPI frequency in Hz, use 0 for maximum supported by the card
+	 *
+	 * The card is identified at 400kHz, then the clock is raised to the card's
+	 * maximum transfer rate (from CSD TRAN_SPEED) limited by `freq`.
+	 *
+	 * If `freq` permits, cards which support it are switched into high-speed mode (CMD6).
 	 */
 	bool begin(uint8_t chipSelect, uint32_t freq = 0);
 
 	void end();
 
+	/**
+	 * @brief Read contiguous sectors into several buffers using a single multiple block transfer
+	 * @param address Byte offset, must be sector-aligned
+	 * @param segments Buffers to fill in order, each a non-zero multiple of the sector size
+	 * @param count Number of segments
+	 */
+	bool readv(storage_size_t address, const MutableSegment* segments, size_t count);
+
+	/**
+	 * @brief Write contiguous sectors from several buffers using a single multiple block transfer
+	 * @param address Byte offset, must be sector-aligned
+	 * @param segments Buffers to write in order, each a non-zero multiple of the sector size
+	 * @param count Number of segments
+	 */
+	bool writev(storage_size_t address, const Segment* segments, size_t count);
+
+	/**
+	 * @brief Read sectors, passing each block to a callback as it arrives
+	 * @param address Byte offset, must be sector-aligned
+	 * @param size Bytes to read, must be a multiple of the sector size
+	 * @param callback Invoked for each block in turn
+	 * @retval bool false on error or if callback aborted the read
+	 *
+	 * Any size may be read using a single sector of buffering, as one multiple block transfer.
+	 * Modified sectors in the cache are written back first.
+	 *
+	 * @note The card remains selected whilst the callback runs and won't yield the SPI bus,
+	 * so the callback must not access the card or any other device on the same bus.
+	 */
+	bool readTo(storage_size_t address, storage_size_t size, BlockCallback callback);
+
+	/**
+	 * @brief Read sectors, writing each block to an output stream as it arrives
+	 * @retval bool false on error or if output did not accept all data
+	 */
+	bool readTo(storage_size_t address, storage_size_t size, Print& output)
+	{
+		return readTo(address, size,
+					  [&output](const uint8_t* block, size_t size) { return output.write(block, size) == size; });
+	}
+
+	/**
+	 * @brief Queue an asynchronous read
+	 * @param address Byte offset, must be sector-aligned
+	 * @param dst Buffer for data, must remain valid until callback is invoked
+	 * @param size Bytes to read, must be a multiple of the sector size
+	 * @param callback Invoked from task context when request completes
+	 * @param priority Requests in a higher class are always serviced first
+	 * @retval bool false if request is invalid, in which case callback is not invoked
+	 *
+	 * Requests are serviced from the task queue, a few sectors at a time,
+	 * so other tasks may run whilst a large transfer is in progress.
+	 * See `RequestQueue` for how requests are ordered and merged.
+	 * The card must not be destroyed with requests outstanding.
+	 */
+	bool submitRead(storage_size_t address, void* dst, size_t size, Callback callback,
+					Priority priority = Priority::normal);
+
+	/**
+	 * @brief Queue an asynchronous write
+	 * @param address Byte offset, must be sector-aligned
+	 * @param src Data to write, must remain valid until callback is invoked
+	 * @param size Bytes to write, must be a multiple of the sector size
+	 * @param callback Invoked from task context when request completes
+	 * @param priority Requests in a higher class are always serviced first
+	 * @retval bool false if request is invalid, in which case callback is not invoked
+	 */
+	bool submitWrite(storage_size_t address, const void* src, size_t size, Callback callback,
+					 Priority priority = Priority::normal);
+
+	/**
+	 * @brief Queue an asynchronous write which is sent to the card as one multiple block transfer
+	 *
+	 * Parameters are as for `submitWrite()`. The request is not split into chunks or merged with others,
+	 * so the task queue is held up for the whole transfer. Use where the card benefits from
+	 * receiving data in large pieces, such as sequential logging.
+	 */
+	bool submitBurst(storage_size_t address, const void* src, size_t size, Callback callback,
+					 Priority priority = Priority::normal);
+
+	/**
+	 * @brief Queue a background discard of unwanted data
+	 * @param address Byte offset, must be sector-aligned
+	 * @param size Bytes to discard, must be a multiple of the sector size
+	 * @param callback Invoked from task context when request completes
+	 * @retval bool false if request is invalid, in which case callback is not invoked
+	 *
+	 * The range is split on erase unit (see `getBlockSize()`) boundaries and one unit erased
+	 * at a time, only when no other requests are pending.
+	 * Sectors which don't fill a unit are handled according to `setDiscardPolicy()`.
+	 */
+	bool submitDiscard(storage_size_t address, storage_size_t size, Callback callback);
+
+	/**
+	 * @brief Set how discards handle sectors which don't fill an erase unit
+	 */
+	void setDiscardPolicy(DiscardPolicy policy)
+	{
+		requests.setDiscardPolicy(policy);
+	}
+
+	DiscardPolicy getDiscardPolicy() const
+	{
+		return requests.getDiscardPolicy();
+	}
+
+	/**
+	 * @brief Control handling of card busy state after writes and erases
+	 * @param enable true (default) to return as soon as the card accepts the data
+	 *
+	 * With deferred busy handling the card programs its flash whilst the application
+	 * continues, and the next command (or `sync()`) waits for it to finish.
+	 * Programming errors are then reported by `sync()`.
+	 *
+	 * If disabled, writes and erases wait for completion and check the card status before returning.
+	 */
+	void setDeferredBusy(bool enable)
+	{
+		deferredBusy = enable;
+	}
+
+	bool getDeferredBusy() const
+	{
+		return deferredBusy;
+	}
+
+	/**
+	 * @brief Stream sequential reads using an open-ended multiple block read
+	 * @param enable true to keep the read session open between calls
+	 * @param readAheadSectors Number of sectors to prefetch into a buffer, 0 for none
+	 * @retval bool false if read-ahead buffer could not be allocated
+	 *
+	 * When a read continues from where the previous one finished, READ_MULTIPLE_BLOCK is
+	 * issued and left open so subsequent contiguous reads only fetch data blocks.
+	 * Any other command ends the session.
+	 *
+	 * If a read-ahead buffer is configured, the next sectors are fetched from the task queue
+	 * so they are already available when the application asks for them.
+	 *
+	 * @note The card remains selected whilst a session is open. If another client of the `SpiBus`
+	 * needs the bus then the session is closed first.
+	 */
+	bool setReadStream(bool enable, size_t readAheadSectors = 0);
+
+	bool getReadStream() const
+	{
+		return readStream;
+	}
+
+	/**
+	 * @brief Keep a multiple block write open whilst writes are contiguous
+	 * @param enable true to keep the write session open between calls
+	 * @param preEraseSectors Expected length of the stream, 0 for none.
+	 * Each session which continues the stream pre-erases (ACMD23) only the sectors still to be written.
+	 * Cache write-backs and writes elsewhere are never pre-erased; a write into the part of the stream
+	 * not yet reached ends pre-erasure.
+	 * @param timeoutMs Session ends if no further writes are made within this time, 0 to disable
+	 *
+	 * Data blocks are sent as soon as they are written, but the card is only told the transfer
+	 * has finished (STOP_TRAN) when a non-contiguous write, read, erase or `sync()` occurs,
+	 * or on timeout.
+	 *
+	 * @note If the stream is shorter than the pre-erase count, the contents of the remaining
+	 * pre-erased sectors are undefined.
+	 * @note The card remains selected whilst a session is open, as for `setReadStream()`.
+	 */
+	void setWriteStream(bool enable, uint32_t preEraseSectors = 0, uint16_t timeoutMs = 100);
+
+	bool getWriteStream() const
+	{
+		return writeStream;
+	}
+
+	/**
+	 * @brief Set size of write-back sector cache
+	 * @param sectors Number of sectors to cache, 0 to disable
+	 * @retval bool false if cache could not be flushed or allocated
+	 *
+	 * Single-sector reads and writes are held in RAM until the cache is full or `sync()` is called.
+	 * Modified sectors are then written in ascending order, contiguous runs using a multiple block write.
+	 * This suits filing system metadata which is repeatedly updated in small writes.
+	 *
+	 * @note Modified sectors are lost on power failure unless `sync()` has been called.
+	 * @note Any pinned sectors are released.
+	 */
+	bool setCacheSize(size_t sectors);
+
+	size_t getCacheSize() const
+	{
+		return cache.getCapacity();
+	}
+
+	/**
+	 * @brief Keep a range of sectors in the cache
+	 * @param sector First sector number
+	 * @param count Number of sectors
+	 * @retval bool false if cache is too small; at least one entry is always left unpinned
+	 *
+	 * Use for frequently accessed metadata such as the partition table and filing system boot sectors.
+	 * Pinned sectors are loaded on first access, so pin before calling `begin()` to capture the partition scan.
+	 */
+	bool pinSectors(storage_size_t sector, size_t count)
+	{
+		return cache.pin(sector, count);
+	}
+
+	void unpinSectors(storage_size_t sector, size_t count)
+	{
+		cache.unpin(sector, count);
+	}
+
+	SpiBus& getBus()
+	{
+		return bus;
+	}
+
+	/**
+	 * @brief Get the SPI clock frequency in use
+	 */
+	uint32_t getFrequency() const
+	{
+		return frequency;
+	}
+
+	/**
+	 * @brief Get maximum time to wait for a data block when reading
+	 * @retval uint32_t Microseconds
+	 *
+	 * For standard capacity cards this is derived from TAAC and NSAC in the CSD,
+	 * otherwise the fixed value from the SD specification is used.
+	 */
+	uint32_t getReadTimeout() const
+	{
+		return readTimeout;
+	}
+
+	/**
+	 * @brief Get maximum time to wait for programming to complete after writing a data block
+	 * @retval uint32_t Microseconds
+	 */
+	uint32_t getWriteTimeout() const
+	{
+		return writeTimeout;
+	}
+
+	/**
+	 * @brief Get the bus access mode negotiated with the card
+	 */
+	AccessMode getAccessMode() const
+	{
+		return accessMode;
+	}
+
+	/**
+	 * @brief Get instrumentation counters
+	 * @note Empty if built with SD_ENABLE_METRICS=0
+	 */
+	const Metrics& getMetrics() const
+	{
+		return metrics;
+	}
+
+	void resetMetrics()
+	{
+		metrics = {};
+	}
+
+	/**
+	 * @brief Get number of asynchronous requests outstanding
+	 */
+	size_t getPendingRequests() const
+	{
+		return requests.count();
+	}
+
+	/**
+	 * @brief Check whether a read-ahead fetch is waiting to run from the task queue
+	 */
+	bool isReadAheadQueued() const
+	{
+		return readAhead.task.isQueued();
+	}
+
+	/**
+	 * @brief Synchronously service the next chunk of queued requests
+	 * @retval bool false if no requests are pending
+	 *
+	 * Use to wait for a particular request to complete without also completing
+	 * lower priority work such as discards, as `sync()` would.
+	 */
+	bool serviceRequests()
+	{
+		if(requests.count() == 0) {
+			return false;
+		}
+		requests.service();
+		return true;
+	}
+
 	/* Storage Device methods */
 
 	String getName() const override
@@ -57,13 +412,25 @@ public:
 		return Type::sdcard;
 	}
 
+	/**
+	 * @brief Get optimal alignment and granularity for writes and erasures
+	 *
+	 * This is the allocation unit (AU) size from the SD Status register if available,
+	 * otherwise the erase sector size from the CSD.
+	 */
 	size_t getBlockSize() const override
 	{
+		auto auSize = mSSR.getAllocationUnitSize();
+		if(auSize != 0) {
+			return auSize;
+		}
 		return size_t(mCSD.sector_size() + 1) << sectorSizeShift;
 	}
 
 	const CID& cid{mCID};
 	const CSD& csd{mCSD};
+	const SSR& ssr{mSSR}; ///< SD Status, zeroed if not supported by card
+	const SCR& scr{mSCR}; ///< SD Configuration, zeroed if not supported by card
 
 protected:
 	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
@@ -72,21 +439,179 @@ protected:
 	bool raw_sync() override;
 
 private:
+	friend RequestQueue;
+	friend SectorCache;
+	friend class Worker;
+
+	// Maximum values from SD specification, used until card is identified
+	static constexpr uint32_t defaultReadTimeout{100000};
+	static constexpr uint32_t defaultWriteTimeout{500000};
+	// Limits for timeouts derived from the CSD, which may be implausibly small or zero
+	static constexpr uint32_t minReadTimeout{10000};
+	static constexpr uint32_t minWriteTimeout{50000};
+	static constexpr uint32_t maxReadTimeout{100000};
+	static constexpr uint32_t maxWriteTimeout{250000};
+
+	enum class Session {
+		none,
+		read,  ///< READ_MULTIPLE_BLOCK in progress
+		write, ///< WRITE_MULTIPLE_BLOCK in progress
+	};
+
+	/**
+	 * @brief Sectors prefetched from an open read session
+	 */
+	struct ReadAhead {
+		ReadAhead(Card& card) : task(readAheadTask, &card)
+		{
+		}
+
+		std::unique_ptr<uint8_t[]> buffer;
+		size_t capacity{0};		  ///< Size of buffer in sectors
+		size_t pos{0};			  ///< Index of first valid sector in buffer
+		size_t count{0};		  ///< Number of valid sectors
+		storage_size_t sector{0}; ///< Sector number for buffer[pos]
+		QueuedTask task;
+	};
+
+	enum class PollFor {
+		ready,	  ///< 0xFF: card not busy
+		token,	  ///< Anything other than 0xFF: data token or error
+		response, ///< Bit 7 clear: command response
+	};
+
+	/**
+	 * @brief Bytes received in a polling burst, starting with the one being waited for
+	 */
+	struct PollBuffer {
+		uint8_t data[16];
+		uint8_t pos{0};
+		uint8_t len{0};
+
+		void clear()
+		{
+			pos = len = 0;
+		}
+	};
+
+	/**
+	 * @brief Keep card selected between commands whilst in scope
+	 *
+	 * Commands which follow one another without intervening data, such as CMD32, CMD33 and CMD38,
+	 * then skip the deselect/select cycle and ready wait.
+	 */
+	class CommandBatch
+	{
+	public:
+		CommandBatch(Card& card) : card(card)
+		{
+			++card.batchDepth;
+		}
+
+		~CommandBatch()
+		{
+			--card.batchDepth;
+		}
+
+	private:
+		Card& card;
+	};
+
+	// Burst sizes to suit expected response time
+	static constexpr uint8_t readyBurstSize{4};
+	static constexpr uint8_t responseBurstSize{8};
+
+	bool submit(RequestQueue::Kind kind, Priority priority, storage_size_t address, void* buffer, storage_size_t size,
+				Callback callback, bool burst = false);
+	bool yieldBus() override;
+	template <typename T> size_t check_segments(storage_size_t address, const SegmentT<T>* segments, size_t count);
 	uint8_t init();
-	bool wait_ready();
+	void setFrequency(uint32_t freq);
+	bool read_csd();
+	bool read_ssr();
+	bool read_scr();
+	bool set_block_count(size_t count);
+
+	/*
+	 * Sector numbers are used by block-addressed (SDHC/SDXC) cards, byte offsets by earlier ones
+	 */
+#if SD_ENABLE_BYTE_ADDRESSING
+	bool isBlockAddressed() const;
+#else
+	static constexpr bool isBlockAddressed()
+	{
+		return true;
+	}
+#endif
+
+	bool switch_function(bool set, uint8_t function, SwitchStatus& status);
+	bool switch_high_speed();
+	void set_timeouts();
+	uint32_t get_erase_timeout(size_t sectors);
+	bool wait_ready(uint32_t timeout);
+	bool wait_busy();
 	void deselect();
 	bool select();
 	bool rcvr_datablock(void* buff, size_t btr);
 	bool xmit_datablock(const void* buff, uint8_t token);
 	uint8_t send_cmd(uint8_t cmd, uint32_t arg);
+	bool check_status();
+	bool end_session();
+	static void sessionTimeout(void* param);
+	bool stream_read(storage_size_t sector, MutableBlockList blocks, size_t count);
+	bool stream_write(storage_size_t sector, const BlockList& blocks, size_t count, bool writeBack);
+	bool read_blocks(storage_size_t sector, const MutableBlockList& blocks, size_t count);
+	bool write_blocks(storage_size_t sector, const BlockList& blocks, size_t count);
+	bool read_sectors(storage_size_t sector, const MutableBlockList& blocks, size_t count);
+	bool write_sectors(storage_size_t sector, const BlockList& blocks, size_t count, bool writeBack = false);
+	void queue_read_ahead();
+	static void readAheadTask(void* param);
+	void read_ahead();
+	void send(const void* data, size_t size);
+	void receive(void* data, size_t size);
+	uint8_t receive_byte();
+	bool poll(PollFor what, uint8_t burstSize);
 
 	CString name;
+	std::unique_ptr<SpiBus> ownBus; ///< Created when card is given sole use of a controller
+	SpiBus& bus;
 	SPIBase& spi;
+	SPIExt* spiExt{nullptr};
+	SPISettings spiSettings;
 	CSD mCSD;
 	CID mCID;
+	SSR mSSR{};
+	SCR mSCR{};
+	uint32_t frequency{0};
+	AccessMode accessMode{AccessMode::defaultSpeed};
 	uint8_t chipSelect{255};
 	bool initialised{false};
-	uint8_t cardType; ///< b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing
-};					  // namespace SD
+	bool busy{true};							///< Card may be programming
+	bool deferredBusy{true};					///< Don't wait for programming to complete
+	bool statusPending{false};					///< Data written since status was last checked
+	uint8_t cardType;							///< b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing
+	bool selected{false};						///< Chip select asserted and card ready
+	bool blockCountSupported{false};			///< Use CMD23 for closed-ended transfers
+	uint8_t batchDepth{0};						///< Number of CommandBatch instances in scope
+	uint32_t readTimeout{defaultReadTimeout};	///< Data token wait (us)
+	uint32_t writeTimeout{defaultWriteTimeout};	///< Busy wait after writing data (us)
+	uint32_t busyTimeout{defaultWriteTimeout};	///< Busy wait for current operation (us)
+	bool readStream{false};
+	bool writeStream{false};
+	bool workerActive{false}; ///< Card driven by a Worker thread, so no task queue or timer callbacks
+	bool streamStarted{false};			///< First application write of stream made
+	uint32_t preEraseRemaining{0};	///< Sectors of stream still to be written, for pre-erase
+	storage_size_t streamSector{0}; ///< Next sector expected in stream
+	uint16_t writeTimeoutMs{0};
+	SimpleTimer sessionTimer;
+	Session session{Session::none};
+	storage_size_t sessionSector{0}; ///< Next sector to be transferred in session
+	storage_size_t lastReadEnd{0};	 ///< Sector following the previous read
+	ReadAhead readAhead{*this};
+	PollBuffer pollBuffer;
+	RequestQueue requests;
+	SectorCache cache{*this};
+	Metrics metrics{};
+}; // namespace SD
 
 } // namespace Storage::SD
@@ -0,0 +1,211 @@
+/*
+	SPI-mode SD card emulator for the Host architecture.
+
+	Presents itself as an SPI controller so that `Card` can be exercised without hardware.
+	Card contents are kept in a sparse image file.
+*/
+
+#pragma once
+
+#include "SPIExt.h"
+#include <WString.h>
+#include <vector>
+
+namespace Storage::SD
+{
+/**
+ * @brief Emulates an SD card attached to an SPI bus
+ *
+ * Commands are decoded from the MOSI byte stream and responses, data tokens and
+ * busy signalling are returned on MISO as a real card would. Chip select is not
+ * observed: the card responds to any well-formed command frame.
+ *
+ * Only available on the Host architecture.
+ */
+class Emulator : public SPIExt
+{
+public:
+	enum class Kind {
+		sdv1, ///< SDSC ver 1.XX: no CMD8, byte addressing
+		sdsc, ///< SDSC ver 2.XX: byte addressing
+		sdhc, ///< SDHC/SDXC: block addressing
+	};
+
+	/**
+	 * @brief Card timing model
+	 *
+	 * Delays are measured in real time from the point the card starts the operation.
+	 */
+	struct Timing {
+		uint32_t readAccessUs{100};		 ///< Delay before each data block is available
+		uint32_t writeBusyUs{250};		 ///< Busy time after each block is written
+		uint32_t eraseBusyUs{2000};		 ///< Fixed busy time for an erase command
+		uint32_t eraseBlockBusyNs{1000}; ///< Additional busy time per erased sector
+		uint8_t initRetries{2};			 ///< Number of ACMD41 requests answered with 'idle'
+	};
+
+	struct Stats {
+		uint64_t bytes;				///< Total bytes clocked
+		uint32_t commands;			///< Total command frames received, including CMD55 prefixes
+		uint32_t cmd[64];			///< Count of each standard command
+		uint32_t acmd[64];			///< Count of each application-specific command
+		uint32_t blocksRead;		///< Data blocks sent to host
+		uint32_t blocksWritten;		///< Data blocks received from host
+		uint64_t blocksErased;		///< Sectors erased
+		uint32_t blocksPreErased;	///< Sectors pre-erased by ACMD23 but not written
+		uint32_t clockErrors;		///< Commands received with SPI clock faster than card permits
+	};
+
+	/**
+	 * @brief Constructor
+	 * @param filename Path of image file, created if it does not exist
+	 * @param size Card capacity in bytes, must be a multiple of 512KB
+	 * @param kind Type of card to emulate
+	 */
+	Emulator(const String& filename, uint64_t size, Kind kind = Kind::sdhc);
+
+	~Emulator()
+	{
+		end();
+	}
+
+	/* SPIBase methods */
+
+	bool begin() override;
+	void end() override;
+
+	using SPIExt::transfer;
+	uint32_t transfer32(uint32_t val, uint8_t bits = 32) override;
+	void transfer(uint8_t* buffer, size_t size) override;
+
+	/* SPIExt methods */
+
+	void send(const void* data, size_t size) override;
+	void receive(void* data, size_t size) override;
+
+	bool loopback(bool enable) override
+	{
+		(void)enable;
+		return false;
+	}
+
+	uint64_t getSize() const
+	{
+		return uint64_t(sectorCount) << sectorSizeShift;
+	}
+
+	Kind getKind() const
+	{
+		return kind;
+	}
+
+	/**
+	 * @brief Get SPI clock frequency most recently set by the host
+	 */
+	uint32_t getFrequency() const
+	{
+		return frequency;
+	}
+
+	const Stats& getStats() const
+	{
+		return stats;
+	}
+
+	void resetStats()
+	{
+		stats = {};
+	}
+
+	Timing timing;
+
+protected:
+	void prepare(SPISettings& settings) override
+	{
+		frequency = settings.speed.frequency;
+	}
+
+private:
+	static constexpr unsigned sectorSize{512};
+	static constexpr unsigned sectorSizeShift{9};
+
+	enum class State {
+		powerUp,
+		idle,
+		ready,
+	};
+
+	enum class Rx {
+		command,   ///< Waiting for command frame
+		dataToken, ///< Waiting for data token following CMD24/CMD25
+		data,	   ///< Receiving data block
+	};
+
+	enum class Read {
+		none,
+		single, ///< CMD17
+		multi,	///< CMD18
+	};
+
+	uint8_t exchange(uint8_t mosi);
+	uint8_t nextOutput();
+	void receive(uint8_t mosi);
+	void command(uint8_t cmd, uint32_t arg);
+	void respond(uint8_t r1, const void* data = nullptr, size_t len = 0);
+	void queueBlock(const void* data, size_t len);
+	void switchFunction(uint32_t arg);
+	void startRead(Read mode, uint32_t sector);
+	void writeBlock();
+	void endPreErase();
+	void erase();
+	bool addressToSector(uint32_t arg, uint32_t& sector) const;
+	uint8_t r1() const;
+	bool isBusy() const;
+	void setBusy(uint32_t us);
+	void checkClock(uint8_t cmd);
+	void buildCSD();
+	void buildCID();
+	void buildSSR();
+	void buildSCR();
+
+	bool readSectors(uint32_t sector, void* buffer, size_t count);
+	bool writeSectors(uint32_t sector, const void* buffer, size_t count);
+	bool eraseSectors(uint32_t sector, size_t count);
+
+	String filename;
+	int fd{-1};
+	uint32_t sectorCount;
+	Kind kind;
+	State state{State::powerUp};
+	Rx rx{Rx::command};
+	Read read{Read::none};
+	bool appCmd{false};
+	bool writeMulti{false};
+	bool highSpeed{false};
+	uint8_t acmd41Count{0};
+	uint8_t cmdFrame[6];
+	uint8_t cmdLen{0};
+	uint32_t rwSector{0};
+	uint32_t rwCount{0};	///< Blocks remaining in closed-ended transfer, 0 if open-ended
+	uint32_t blockCount{0};	///< Set by CMD23 for next transfer
+	uint32_t readReadyTime{0};
+	uint32_t busyStart{0};
+	uint32_t busyTime{0};
+	uint32_t eraseStart{0};
+	uint32_t eraseEnd{0};
+	bool eraseStartSet{false};
+	bool eraseEndSet{false};
+	uint32_t preEraseCount{0};	///< Set by ACMD23 for next multiple block write
+	uint32_t preEraseEnd{0};	///< Sector following pre-erased range of current write, 0 if none
+	uint32_t frequency{0};
+	uint8_t csd[16];
+	uint8_t cid[16];
+	uint8_t ssr[64];
+	uint8_t scr[8];
+	std::vector<uint8_t> outBuf;
+	size_t outPos{0};
+	std::vector<uint8_t> rxBlock;
+	Stats stats{};
+};
+
+} // namespace Storage::SD
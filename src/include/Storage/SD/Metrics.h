@@ -0,0 +1,119 @@
+/*
+	Instrumentation for diagnosing slow card operations.
+
+	Build with SD_ENABLE_METRICS=0 to remove all instrumentation code.
+*/
+
+#pragma once
+
+#include <Print.h>
+
+#ifndef SD_ENABLE_METRICS
+#define SD_ENABLE_METRICS 1
+#endif
+
+// Wraps instrumentation statements so they compile away when disabled
+#if SD_ENABLE_METRICS
+#define SD_METRICS(...) __VA_ARGS__
+#else
+#define SD_METRICS(...)
+#endif
+
+// Commands with individual statistics: Tag, Command index
+#define SDCARD_METRICS_COMMAND_MAP(XX)                                                                                 \
+	XX(CMD12, 12)                                                                                                      \
+	XX(CMD13, 13)                                                                                                      \
+	XX(CMD17, 17)                                                                                                      \
+	XX(CMD18, 18)                                                                                                      \
+	XX(CMD24, 24)                                                                                                      \
+	XX(CMD25, 25)                                                                                                      \
+	XX(CMD38, 38)
+
+namespace Storage::SD
+{
+#if SD_ENABLE_METRICS
+
+/**
+ * @brief Counters and latency histograms for card operations
+ *
+ * Command latency is measured from the start of `send_cmd` until the response is received,
+ * so includes time spent waiting for the card to finish any previous programming operation.
+ */
+struct Metrics {
+	enum class Command {
+#define XX(tag, index) tag,
+		SDCARD_METRICS_COMMAND_MAP(XX)
+#undef XX
+		other, ///< All other commands, including CMD55 prefixes
+		MAX,
+	};
+
+	/**
+	 * @brief Latency histogram buckets increase by a factor of 4, from < 64us to >= 262ms
+	 */
+	static constexpr unsigned histogramSize{8};
+	static constexpr uint32_t histogramBaseUs{64};
+
+	struct CommandStats {
+		uint32_t count;
+		uint32_t histogram[histogramSize];
+	};
+
+	CommandStats commands[unsigned(Command::MAX)];
+	uint64_t waitReadyUs;	  ///< Total time spent polling for card ready
+	uint32_t tokenTimeouts;	  ///< Data tokens not received whilst reading
+	uint32_t dataRejects;	  ///< Data blocks not accepted by card whilst writing
+	uint64_t bytesRead;		  ///< Data block payload received
+	uint64_t bytesWritten;	  ///< Data block payload sent
+	uint32_t cacheHits;		  ///< Single-sector accesses satisfied by the cache
+	uint32_t cacheMisses;	  ///< Single-sector accesses requiring a new cache entry
+	uint32_t cacheWriteBacks; ///< Dirty sectors written from the cache to the card
+	uint32_t batchedCommands; ///< Commands sent without reselecting card
+	uint32_t mergedRequests;  ///< Queued requests combined into another's transfer
+
+	static Command getCommand(uint8_t cmd)
+	{
+		switch(cmd) {
+#define XX(tag, index)                                                                                                 \
+	case index:                                                                                                        \
+		return Command::tag;
+		SDCARD_METRICS_COMMAND_MAP(XX)
+#undef XX
+		default:
+			return Command::other;
+		}
+	}
+
+	void commandComplete(uint8_t cmd, uint32_t latencyUs)
+	{
+		auto& stats = commands[unsigned(getCommand(cmd))];
+		++stats.count;
+		unsigned bucket{0};
+		for(auto limit = histogramBaseUs; latencyUs >= limit && bucket < histogramSize - 1; limit <<= 2) {
+			++bucket;
+		}
+		++stats.histogram[bucket];
+	}
+
+	size_t printTo(Print& p) const;
+};
+
+#else
+
+/**
+ * @brief Instrumentation disabled
+ */
+struct Metrics {
+	size_t printTo(Print& p) const
+	{
+		return p.println(_F("  Metrics disabled (SD_ENABLE_METRICS=0)"));
+	}
+};
+
+#endif
+
+} // namespace Storage::SD
+
+#if SD_ENABLE_METRICS
+String toString(Storage::SD::Metrics::Command cmd);
+#endif
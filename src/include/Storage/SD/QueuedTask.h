@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Storage::SD
+{
+/**
+ * @brief Task queue callback which may be cancelled
+ *
+ * The system task queue cannot remove an entry once queued, so the callback is given
+ * a small heap-allocated token instead of the owning object. Cancelling the task,
+ * or destroying this object, disarms the token so the pending callback does nothing.
+ */
+class QueuedTask
+{
+public:
+	using Callback = void (*)(void* param);
+
+	QueuedTask(Callback callback, void* param) : callback(callback), param(param)
+	{
+	}
+
+	QueuedTask(const QueuedTask&) = delete;
+	QueuedTask& operator=(const QueuedTask&) = delete;
+
+	~QueuedTask()
+	{
+		cancel();
+	}
+
+	/**
+	 * @brief Queue the callback unless already pending
+	 * @retval bool true if callback is pending
+	 */
+	bool queue();
+
+	/**
+	 * @brief Prevent any pending callback from running
+	 */
+	void cancel();
+
+	bool isQueued() const
+	{
+		return token != nullptr;
+	}
+
+private:
+	struct Token {
+		QueuedTask* task;
+	};
+
+	static void handler(void* param);
+
+	Callback callback;
+	void* param;
+	Token* token{nullptr}; ///< Owned by the task queue once queued
+};
+
+} // namespace Storage::SD
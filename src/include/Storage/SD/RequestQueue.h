@@ -0,0 +1,137 @@
+#pragma once
+
+#include <Storage/Device.h>
+#include <Delegate.h>
+#include <deque>
+#include <memory>
+#include "QueuedTask.h"
+
+namespace Storage::SD
+{
+class Card;
+
+/**
+ * @brief Queue of asynchronous sector requests for a Card
+ *
+ * SPIBase transfers are blocking, so requests are serviced from the task queue
+ * a few sectors at a time. Other tasks run between each chunk.
+ *
+ * Requests are scheduled elevator-style: the highest priority class is serviced first,
+ * and within a class requests are taken in ascending sector order from the last position,
+ * wrapping to the lowest sector (C-SCAN). Contiguous requests of the same kind are merged
+ * into a single multiple block transfer.
+ *
+ * A request is never moved ahead of an earlier one it overlaps unless both are reads,
+ * so data is always seen in submission order.
+ */
+class RequestQueue
+{
+public:
+	/**
+	 * @brief Completion callback
+	 * @param success true if all sectors were transferred
+	 */
+	using Callback = Delegate<void(bool success)>;
+
+	enum class Kind {
+		read,
+		write,
+		erase,
+	};
+
+	enum class Priority {
+		high,		///< Latency-sensitive, e.g. filing system metadata
+		normal,		///< Default
+		background, ///< Only serviced when nothing else is pending
+	};
+
+	/**
+	 * @brief How to handle parts of a discard range which don't fill an erase unit
+	 */
+	enum class DiscardPolicy {
+		skip,  ///< Leave sectors unchanged
+		write, ///< Overwrite sectors with the card's erased value
+	};
+
+	struct Request {
+		Kind kind;
+		Priority priority;
+		storage_size_t sector; ///< First sector
+		size_t count;		   ///< Number of sectors
+		uint8_t* buffer;
+		Callback callback;
+		bool burst{false}; ///< Transfer as one command instead of in chunks
+		size_t done{0};	   ///< Sectors completed
+		bool failed{false};
+
+		storage_size_t next() const
+		{
+			return sector + done;
+		}
+
+		storage_size_t end() const
+		{
+			return sector + count;
+		}
+	};
+
+	/**
+	 * @brief Maximum number of sectors transferred per task callback
+	 */
+	static constexpr size_t maxChunkSectors{8};
+
+	RequestQueue(Card& card) : card(card), task(taskCallback, this)
+	{
+	}
+
+	/**
+	 * @brief Add a request to the queue
+	 */
+	void submit(const Request& request);
+
+	/**
+	 * @brief Complete all outstanding requests synchronously
+	 * @retval bool true if all requests succeeded
+	 * @note Any pending task callback is cancelled, so card may be safely destroyed afterwards
+	 */
+	bool flush();
+
+	size_t count() const
+	{
+		return queue.size();
+	}
+
+	void setDiscardPolicy(DiscardPolicy policy)
+	{
+		discardPolicy = policy;
+	}
+
+	DiscardPolicy getDiscardPolicy() const
+	{
+		return discardPolicy;
+	}
+
+	/**
+	 * @brief Synchronously service the next chunk of the highest priority request
+	 * @retval bool false if request failed
+	 */
+	bool service();
+
+private:
+	static void taskCallback(void* param);
+	void schedule();
+	bool isBlocked(size_t index) const;
+	size_t select() const;
+	bool transfer(size_t index);
+	bool transferBurst(Request& req);
+	bool discard(Request& req);
+
+	Card& card;
+	QueuedTask task;
+	std::deque<Request> queue;
+	std::unique_ptr<uint8_t[]> fillBlock; ///< Erased sector content for DiscardPolicy::write
+	storage_size_t position{0};			  ///< Sector following the last transfer
+	DiscardPolicy discardPolicy{DiscardPolicy::skip};
+};
+
+} // namespace Storage::SD
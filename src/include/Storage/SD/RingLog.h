@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Card.h"
+#include <Storage/Partition.h>
+
+namespace Storage::SD
+{
+/**
+ * @brief Append-only log of records in a raw card partition
+ *
+ * Each record occupies one sector, starting with a header containing its sequence number.
+ * Record `n` is always stored in sector `n % sectorCount` of the partition, overwriting
+ * the oldest records once the partition is full. Sequence numbers are 64 bits so never wrap.
+ *
+ * Records are collected in one of two buffers whilst the other is written asynchronously
+ * as a single multiple block write. When the writer enters an allocation unit (AU) the following
+ * unit is discarded in the background, so the card erases it ahead of time and the newest
+ * record is always followed by an erased gap. This allows the newest and oldest records to be
+ * located at mount by binary search.
+ *
+ * The partition must be aligned to, and a multiple of, the AU size (see `Card::getBlockSize()`),
+ * and contain at least two units.
+ */
+class RingLog
+{
+public:
+	struct Header {
+		uint32_t magic;
+		uint16_t length; ///< Payload bytes following header
+		uint16_t reserved;
+		uint64_t sequence;
+	};
+
+	static constexpr uint32_t headerMagic{0x474c5253}; // "SRLG"
+
+	RingLog(const Partition& partition) : partition(partition)
+	{
+	}
+
+	~RingLog()
+	{
+		end();
+	}
+
+	/**
+	 * @brief Clear partition, discarding all records
+	 * @note Required before first use of a partition
+	 *
+	 * Every sector is overwritten as a discard does not guarantee old records are cleared,
+	 * so this may take some time for large partitions.
+	 */
+	bool format();
+
+	/**
+	 * @brief Locate oldest and newest records and prepare for writing
+	 * @param bufferSectors Number of records written in each burst
+	 */
+	bool begin(size_t bufferSectors = 8);
+
+	/**
+	 * @brief Write any buffered records and release buffers
+	 */
+	void end();
+
+	/**
+	 * @brief Add a record to the log
+	 * @param data Record content
+	 * @param length Size of record, at most `getMaxRecordSize()`
+	 * @retval bool false if record is too large or a write could not be queued
+	 *
+	 * Once a buffer is full it is queued for writing. If the previous buffer is still being
+	 * written, this waits for it to complete.
+	 */
+	bool append(const void* data, size_t length);
+
+	/**
+	 * @brief Write all buffered records to the card
+	 * @retval bool false if any write failed since the previous flush
+	 */
+	bool flush();
+
+	/**
+	 * @brief Read a record
+	 * @param sequence Sequence number of record
+	 * @param data Buffer for content, at least `getMaxRecordSize()` bytes
+	 * @param length On success, size of record
+	 * @retval bool false if record is not available
+	 * @note Records still being buffered cannot be read until they've been written
+	 */
+	bool read(uint64_t sequence, void* data, size_t& length);
+
+	/**
+	 * @brief Get sequence number of oldest record
+	 */
+	uint64_t getTail() const
+	{
+		return tail;
+	}
+
+	/**
+	 * @brief Get sequence number for next record to be appended
+	 */
+	uint64_t getHead() const
+	{
+		return head;
+	}
+
+	size_t getMaxRecordSize() const
+	{
+		return sectorSize - sizeof(Header);
+	}
+
+private:
+	bool init();
+	bool recover();
+	bool readHeader(uint32_t pos, Header& header);
+	bool preErase(uint64_t sequence);
+	bool submit();
+	uint64_t getWritten() const;
+
+	uint8_t* getBuffer(unsigned index)
+	{
+		return buffer.get() + index * bufferSectors * sectorSize;
+	}
+
+	// Single sector for reading
+	uint8_t* getScratch()
+	{
+		return getBuffer(2);
+	}
+
+	Partition partition;
+	Card* card{nullptr};
+	std::unique_ptr<uint8_t[]> buffer; ///< Two write buffers plus one sector for reading
+	size_t bufferSectors{0};
+	uint32_t sectorCount{0};   ///< Sectors in partition
+	uint32_t unitSectors{0};   ///< Sectors per allocation unit
+	uint64_t head{0};		   ///< Next sequence number
+	uint64_t tail{0};		   ///< Oldest sequence number
+	uint64_t bufferStart[2]{}; ///< Sequence number of first record in each buffer
+	size_t activeCount{0};	   ///< Records in active buffer
+	uint16_t sectorSize{0};
+	uint8_t active{0}; ///< Buffer being filled
+	bool busy[2]{};	   ///< Buffer being written
+	bool writeError{false};
+	bool readError{false};
+};
+
+} // namespace Storage::SD
@@ -0,0 +1,74 @@
+/*
+	SD Configuration Register, returned in the 64-bit data block following ACMD51 (SEND_SCR).
+
+	Bit positions are as per the SD Physical Layer specification, using the same approach as for the CSD.
+*/
+
+#pragma once
+
+#include <Print.h>
+
+// Tag, Type, Start Bit, Size
+#define SDCARD_SCR_MAP(XX)                                                                                             \
+	XX(scr_structure, uint8_t, 60, 4)                                                                                  \
+	XX(sd_spec, uint8_t, 56, 4)                                                                                        \
+	XX(data_stat_after_erase, bool, 55, 1)                                                                             \
+	XX(sd_security, uint8_t, 52, 3)                                                                                    \
+	XX(sd_bus_widths, uint8_t, 48, 4)                                                                                  \
+	XX(sd_spec3, bool, 47, 1)                                                                                          \
+	XX(ex_security, uint8_t, 43, 4)                                                                                    \
+	XX(sd_spec4, bool, 42, 1)                                                                                          \
+	XX(sd_specx, uint8_t, 38, 4)                                                                                       \
+	XX(cmd_support, uint8_t, 32, 4)
+
+namespace Storage::SD
+{
+struct SCR {
+	uint32_t raw_bits[2];
+
+	/**
+	 * @brief Bits in `cmd_support` field
+	 */
+	enum CommandSupport {
+		CMD20_SUPPORT = 0x01, ///< Speed class control
+		CMD23_SUPPORT = 0x02, ///< SET_BLOCK_COUNT
+		CMD48_SUPPORT = 0x04, ///< Extension register single block read/write
+		CMD58_SUPPORT = 0x08, ///< Extension register multi-block read/write
+	};
+
+	void bswap()
+	{
+		for(auto& w : raw_bits) {
+			w = __builtin_bswap32(w);
+		}
+	}
+
+#define XX(tag, Type, start, len, ...)                                                                                 \
+	Type tag() const                                                                                                   \
+	{                                                                                                                  \
+		return Type(readBits(start, len));                                                                             \
+	}
+	SDCARD_SCR_MAP(XX)
+#undef XX
+
+	/**
+	 * @brief Determine whether card accepts CMD23 to set length of multiple block transfers
+	 */
+	bool supportsSetBlockCount() const
+	{
+		return cmd_support() & CMD23_SUPPORT;
+	}
+
+	size_t printTo(Print& p) const;
+
+protected:
+	uint32_t readBits(uint8_t start, uint8_t size) const
+	{
+		const uint32_t mask = (size < 32 ? 1U << size : 0) - 1U;
+		return (raw_bits[1 - (start / 32)] >> (start & 31)) & mask;
+	}
+};
+
+static_assert(sizeof(SCR) == 8, "Bad SCR struct");
+
+} // namespace Storage::SD
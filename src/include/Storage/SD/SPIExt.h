@@ -0,0 +1,36 @@
+#pragma once
+
+#include <SPIBase.h>
+
+namespace Storage::SD
+{
+/**
+ * @brief SPI interface with additional one-directional transfers
+ *
+ * `SPIBase` only supports full-duplex transfers, which overwrite the source buffer.
+ * Controllers which can transmit without receiving, or receive with MOSI held high,
+ * should implement this interface so that `Card` can transfer data blocks directly
+ * to or from the caller's buffer.
+ */
+class SPIExt : public SPIBase
+{
+public:
+	using SPIBase::SPIBase;
+	using SPIBase::transfer;
+
+	/**
+	 * @brief Send a block of data, discarding anything received
+	 * @param data Data to send, not modified
+	 * @param size Number of bytes to send
+	 */
+	virtual void send(const void* data, size_t size) = 0;
+
+	/**
+	 * @brief Receive a block of data whilst holding MOSI high
+	 * @param data Buffer for received data, need not be initialised
+	 * @param size Number of bytes to receive
+	 */
+	virtual void receive(void* data, size_t size) = 0;
+};
+
+} // namespace Storage::SD
@@ -0,0 +1,92 @@
+/*
+	SD Status register, returned in the 512-bit data block following ACMD13 (SD_STATUS).
+
+	Bit positions are as per the SD Physical Layer specification, using the same approach as for the CSD.
+*/
+
+#pragma once
+
+#include <Print.h>
+
+// Tag, Type, Start Bit, Size
+#define SDCARD_SSR_MAP(XX)                                                                                             \
+	XX(dat_bus_width, uint8_t, 510, 2)                                                                                 \
+	XX(secured_mode, bool, 509, 1)                                                                                     \
+	XX(sd_card_type, uint16_t, 480, 16)                                                                                \
+	XX(size_of_protected_area, uint32_t, 448, 32)                                                                      \
+	XX(speed_class, uint8_t, 440, 8)                                                                                   \
+	XX(performance_move, uint8_t, 432, 8)                                                                              \
+	XX(au_size, uint8_t, 428, 4)                                                                                       \
+	XX(erase_size, uint16_t, 408, 16)                                                                                  \
+	XX(erase_timeout, uint8_t, 402, 6)                                                                                 \
+	XX(erase_offset, uint8_t, 400, 2)                                                                                  \
+	XX(uhs_speed_grade, uint8_t, 396, 4)                                                                               \
+	XX(uhs_au_size, uint8_t, 392, 4)                                                                                   \
+	XX(video_speed_class, uint8_t, 384, 8)                                                                             \
+	XX(vsc_au_size, uint16_t, 368, 10)                                                                                 \
+	XX(sus_addr, uint32_t, 346, 22)                                                                                    \
+	XX(app_perf_class, uint8_t, 336, 4)                                                                                \
+	XX(performance_enhance, uint8_t, 328, 8)                                                                           \
+	XX(discard_support, bool, 313, 1)                                                                                  \
+	XX(fule_support, bool, 312, 1)
+
+namespace Storage::SD
+{
+struct SSR {
+	uint32_t raw_bits[16];
+
+	void bswap()
+	{
+		for(auto& w : raw_bits) {
+			w = __builtin_bswap32(w);
+		}
+	}
+
+#define XX(tag, Type, start, len, ...)                                                                                 \
+	Type tag() const                                                                                                   \
+	{                                                                                                                  \
+		return Type(readBits(start, len));                                                                             \
+	}
+	SDCARD_SSR_MAP(XX)
+#undef XX
+
+	/**
+	 * @brief Get size of allocation unit (AU) in bytes, 0 if not defined
+	 *
+	 * This is the unit in which the card manages its flash, so is the optimal
+	 * alignment and size for writes and erasures.
+	 */
+	uint32_t getAllocationUnitSize() const;
+
+	/**
+	 * @brief Get speed class (minimum sequential write performance in MB/s)
+	 * @retval uint8_t 0, 2, 4, 6 or 10
+	 */
+	uint8_t getSpeedClass() const;
+
+	/**
+	 * @brief Get timeout for an erase operation
+	 * @param units Number of allocation units being erased
+	 * @retval uint32_t Milliseconds, 0 if not specified by card
+	 */
+	uint32_t getEraseTimeout(uint32_t units) const;
+
+	size_t printTo(Print& p) const;
+
+protected:
+	uint32_t readBits(uint16_t start, uint8_t size) const
+	{
+		const uint32_t mask = (size < 32 ? 1U << size : 0) - 1U;
+		const unsigned off = 15 - (start / 32);
+		const unsigned shift = start & 31;
+		uint32_t res = raw_bits[off] >> shift;
+		if(size + shift > 32) {
+			res |= raw_bits[off - 1] << ((32 - shift) % 32);
+		}
+		return res & mask;
+	}
+};
+
+static_assert(sizeof(SSR) == 64, "Bad SSR struct");
+
+} // namespace Storage::SD
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <Storage/Device.h>
+#include <memory>
+#include "BlockList.h"
+
+namespace Storage::SD
+{
+class Card;
+
+/**
+ * @brief Write-back cache for single-sector card accesses
+ *
+ * Filing system metadata (FAT tables, directory entries) is typically read and
+ * written one sector at a time, and the same sectors are updated repeatedly.
+ * Holding these in RAM turns many small writes into a few multiple block writes.
+ *
+ * Sectors are evicted on a least-recently-used basis. Evicting a dirty sector
+ * causes all dirty sectors to be written back, sorted into contiguous runs.
+ *
+ * Sectors may be pinned so they are never evicted, for example the partition table
+ * and filing system boot sectors. These are loaded on first access.
+ *
+ * Larger transfers go directly to the card, with any cached copies kept consistent.
+ */
+class SectorCache
+{
+public:
+	SectorCache(Card& card) : card(card)
+	{
+	}
+
+	/**
+	 * @brief Set number of sectors to cache, 0 to disable
+	 * @retval bool false if allocation failed, in which case cache is disabled
+	 * @note Caller must flush any dirty sectors first. All pins are removed.
+	 */
+	bool setCapacity(size_t sectors);
+
+	size_t getCapacity() const
+	{
+		return capacity;
+	}
+
+	explicit operator bool() const
+	{
+		return capacity != 0;
+	}
+
+	/**
+	 * @brief Get number of sectors waiting to be written to the card
+	 */
+	size_t getDirtyCount() const;
+
+	bool read(storage_size_t sector, const MutableBlockList& blocks, size_t count);
+	bool write(storage_size_t sector, const BlockList& blocks, size_t count);
+
+	/**
+	 * @brief Keep sectors in the cache until unpinned
+	 * @retval bool false if there is insufficient space, in which case no sectors are pinned
+	 */
+	bool pin(storage_size_t sector, size_t count);
+
+	void unpin(storage_size_t sector, size_t count);
+
+	/**
+	 * @brief Discard sectors without writing back, e.g. because they've been erased
+	 * @note Pinned sectors remain pinned and are re-loaded on next access
+	 */
+	void invalidate(storage_size_t sector, size_t count);
+
+	/**
+	 * @brief Discard all cached data, e.g. because card has been changed
+	 */
+	void invalidate()
+	{
+		invalidate(0, SIZE_MAX);
+	}
+
+	/**
+	 * @brief Write all dirty sectors to the card
+	 */
+	bool flush();
+
+private:
+	struct Entry {
+		storage_size_t sector;
+		uint32_t lastUse; ///< Value of useCounter when last accessed
+		bool valid;		  ///< Entry is assigned to `sector`
+		bool loaded;	  ///< Entry contains data
+		bool dirty;		  ///< Data must be written to card
+		bool pinned;	  ///< Never evict
+
+		bool contains(storage_size_t start, size_t count) const
+		{
+			return valid && sector >= start && sector - start < count;
+		}
+	};
+
+	Entry* find(storage_size_t sector);
+	Entry* allocate(storage_size_t sector);
+	size_t getFreeCount() const;
+	uint8_t* getData(const Entry& entry);
+
+	Card& card;
+	std::unique_ptr<Entry[]> entries;
+	std::unique_ptr<uint8_t[]> buffer;
+	size_t capacity{0};
+	uint32_t useCounter{0};
+};
+
+} // namespace Storage::SD
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "SPIExt.h"
+
+namespace Storage::SD
+{
+/**
+ * @brief Arbitrates access to an SPI controller shared by several devices
+ *
+ * Each client acquires the bus for a transaction using its own settings.
+ * The controller is only reconfigured when ownership passes to a different client,
+ * so devices with different clock speeds or modes keep their own configuration.
+ *
+ * A client may keep the bus between transactions, as a card does with an open streaming session.
+ * If another client then needs the bus, the owner is asked to yield it.
+ *
+ * The controller is started when the first client attaches and stopped when the last one detaches.
+ *
+ * @note All clients must run in the same task. Use `Worker` to access a card from other threads.
+ */
+class SpiBus
+{
+public:
+	class Client
+	{
+	public:
+		virtual ~Client()
+		{
+		}
+
+		/**
+		 * @brief Called when another client needs the bus
+		 * @retval bool true if the bus has been released
+		 */
+		virtual bool yieldBus() = 0;
+	};
+
+	SpiBus(SPIBase& spi) : spi(spi)
+	{
+	}
+
+	/**
+	 * @brief Use an SPI controller with extended capabilities
+	 */
+	SpiBus(SPIExt& spi) : spi(spi), spiExt(&spi)
+	{
+	}
+
+	/**
+	 * @brief Register a client, starting the controller if required
+	 */
+	bool attach();
+
+	/**
+	 * @brief Unregister a client, stopping the controller if no others remain
+	 */
+	void detach(Client& client);
+
+	/**
+	 * @brief Obtain exclusive use of the bus
+	 * @param client
+	 * @param settings Applied to the controller unless this client was the last to use it
+	 * @retval bool false if the current owner could not release the bus
+	 */
+	bool acquire(Client& client, SPISettings& settings);
+
+	/**
+	 * @brief Give up the bus. Has no effect if client is not the owner.
+	 */
+	void release(Client& client);
+
+	/**
+	 * @brief Notify bus that settings for a client have changed
+	 *
+	 * If client owns the bus then the new settings are applied immediately,
+	 * otherwise on next acquisition.
+	 */
+	void update(Client& client, SPISettings& settings);
+
+	bool isOwner(const Client& client) const
+	{
+		return owner == &client;
+	}
+
+	uint8_t getClientCount() const
+	{
+		return clientCount;
+	}
+
+	SPIBase& getController() const
+	{
+		return spi;
+	}
+
+	/**
+	 * @brief Get extended controller interface, if available
+	 */
+	SPIExt* getControllerExt() const
+	{
+		return spiExt;
+	}
+
+private:
+	SPIBase& spi;
+	SPIExt* spiExt{nullptr};
+	Client* owner{nullptr};		 ///< Client with exclusive use of the bus
+	Client* configured{nullptr}; ///< Client whose settings were last applied to the controller
+	uint8_t clientCount{0};
+};
+
+} // namespace Storage::SD
@@ -0,0 +1,82 @@
+/*
+	Switch function status, returned in the 512-bit data block following CMD6 (SWITCH_FUNC).
+
+	Bit positions are as per the SD Physical Layer specification, using the same approach as for the CSD.
+*/
+
+#pragma once
+
+#include <Print.h>
+
+// Tag, Type, Start Bit, Size
+#define SDCARD_SWITCH_STATUS_MAP(XX)                                                                                   \
+	XX(max_current, uint16_t, 496, 16)                                                                                 \
+	XX(group6_support, uint16_t, 480, 16)                                                                              \
+	XX(group5_support, uint16_t, 464, 16)                                                                              \
+	XX(group4_support, uint16_t, 448, 16)                                                                              \
+	XX(group3_support, uint16_t, 432, 16)                                                                              \
+	XX(group2_support, uint16_t, 416, 16)                                                                              \
+	XX(group1_support, uint16_t, 400, 16)                                                                              \
+	XX(group6_result, uint8_t, 396, 4)                                                                                 \
+	XX(group5_result, uint8_t, 392, 4)                                                                                 \
+	XX(group4_result, uint8_t, 388, 4)                                                                                 \
+	XX(group3_result, uint8_t, 384, 4)                                                                                 \
+	XX(group2_result, uint8_t, 380, 4)                                                                                 \
+	XX(group1_result, uint8_t, 376, 4)                                                                                 \
+	XX(structure_version, uint8_t, 368, 8)                                                                             \
+	XX(group1_busy, uint16_t, 272, 16)
+
+namespace Storage::SD
+{
+struct SwitchStatus {
+	uint32_t raw_bits[16];
+
+	/**
+	 * @brief Function group 1 selects the bus access mode
+	 */
+	enum class AccessMode {
+		defaultSpeed = 0, ///< 25MHz
+		highSpeed = 1,	  ///< 50MHz
+	};
+
+	/**
+	 * @brief Value returned in a result field if the requested function cannot be selected
+	 */
+	static constexpr uint8_t functionError{0x0f};
+
+	void bswap()
+	{
+		for(auto& w : raw_bits) {
+			w = __builtin_bswap32(w);
+		}
+	}
+
+#define XX(tag, Type, start, len, ...)                                                                                 \
+	Type tag() const                                                                                                   \
+	{                                                                                                                  \
+		return Type(readBits(start, len));                                                                             \
+	}
+	SDCARD_SWITCH_STATUS_MAP(XX)
+#undef XX
+
+	bool supports(AccessMode mode) const
+	{
+		return group1_support() & (1U << unsigned(mode));
+	}
+
+	size_t printTo(Print& p) const;
+
+protected:
+	// Fields never straddle a 32-bit boundary
+	uint32_t readBits(uint16_t start, uint8_t size) const
+	{
+		const uint32_t mask = (size < 32 ? 1U << size : 0) - 1U;
+		const unsigned off = 15 - (start / 32);
+		const unsigned shift = start & 31;
+		return (raw_bits[off] >> shift) & mask;
+	}
+};
+
+static_assert(sizeof(SwitchStatus) == 64, "Bad SwitchStatus struct");
+
+} // namespace Storage::SD
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "Card.h"
+
+#if defined(ARCH_ESP32) || defined(ARCH_HOST)
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Storage::SD
+{
+/**
+ * @brief Bounded lock-free multiple producer, multiple consumer queue
+ * @tparam T Type of item, typically a pointer
+ * @tparam capacity Maximum number of items, must be a power of 2
+ *
+ * Each cell carries a sequence number indicating whether it's ready to be written or read
+ * for the current lap, so producers and consumers only contend on their own position counter.
+ */
+template <typename T, size_t capacity> class MpmcQueue
+{
+public:
+	static_assert(capacity >= 2 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of 2");
+
+	MpmcQueue()
+	{
+		for(size_t i = 0; i < capacity; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * @brief Add an item
+	 * @retval bool false if queue is full
+	 */
+	bool push(const T& value)
+	{
+		auto pos = enqueuePos.load(std::memory_order_relaxed);
+		for(;;) {
+			auto& cell = cells[pos & mask];
+			auto seq = cell.sequence.load(std::memory_order_acquire);
+			auto diff = intptr_t(seq) - intptr_t(pos);
+			if(diff == 0) {
+				if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * @brief Remove the oldest item
+	 * @retval bool false if queue is empty
+	 */
+	bool pop(T& value)
+	{
+		auto pos = dequeuePos.load(std::memory_order_relaxed);
+		for(;;) {
+			auto& cell = cells[pos & mask];
+			auto seq = cell.sequence.load(std::memory_order_acquire);
+			auto diff = intptr_t(seq) - intptr_t(pos + 1);
+			if(diff == 0) {
+				if(dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = cell.value;
+					cell.sequence.store(pos + capacity, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool empty() const
+	{
+		return enqueuePos.load(std::memory_order_acquire) == dequeuePos.load(std::memory_order_acquire);
+	}
+
+private:
+	static constexpr size_t mask{capacity - 1};
+
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	Cell cells[capacity];
+	std::atomic<size_t> enqueuePos{0};
+	std::atomic<size_t> dequeuePos{0};
+};
+
+/**
+ * @brief Service card requests from a dedicated thread
+ *
+ * The worker thread owns the card and its SPI bus. Other threads submit requests through
+ * a bounded lock-free queue and block until they complete, so no lock is held whilst
+ * transfers are in progress.
+ *
+ * Requests which are waiting when the worker becomes free are handled as a batch, sorted by
+ * address with contiguous reads or writes merged into a single multiple block transfer.
+ * As each submitting thread waits for its own request, the order in which requests from
+ * different threads complete is not defined.
+ *
+ * Whilst the worker is running the card must not be accessed in any other way.
+ *
+ * @note Only available on architectures with thread support (ESP32, Host)
+ */
+class Worker
+{
+public:
+	/**
+	 * @brief Maximum number of requests queued
+	 */
+	static constexpr size_t queueSize{16};
+
+	Worker(Card& card) : card(card)
+	{
+	}
+
+	~Worker()
+	{
+		stop();
+	}
+
+	/**
+	 * @brief Start the worker thread
+	 * @note Card must already be initialised. Any asynchronous requests are completed first,
+	 * and none may be submitted whilst the worker is running. Streaming sessions remain available
+	 * but without read-ahead or write session timeout, as these run from the task queue.
+	 */
+	bool start();
+
+	/**
+	 * @brief Complete outstanding requests and stop the worker thread
+	 * @note Other threads must not submit requests whilst the worker is stopping
+	 */
+	void stop();
+
+	bool isRunning() const
+	{
+		return running;
+	}
+
+	/* Blocking request methods, may be called from any thread */
+
+	bool read(storage_size_t address, void* dst, size_t size);
+	bool write(storage_size_t address, const void* src, size_t size);
+	bool erase_range(storage_size_t address, storage_size_t size);
+	bool sync();
+
+private:
+	enum class Kind {
+		read,
+		write,
+		erase,
+		sync,
+	};
+
+	struct Request {
+		Kind kind;
+		storage_size_t address;
+		storage_size_t size;
+		void* buffer;
+		bool done;
+		bool success;
+	};
+
+	bool execute(Kind kind, storage_size_t address, void* buffer, storage_size_t size);
+	void run();
+	void process(Request** batch, size_t count);
+	size_t transfer(Request** batch, size_t count);
+	void complete(Request& req, bool success);
+
+	Card& card;
+	std::thread thread;
+	MpmcQueue<Request*, queueSize> queue;
+	std::mutex mutex;
+	std::condition_variable workReady;	  ///< Worker waits for requests
+	std::condition_variable spaceReady;	  ///< Producers wait for queue space
+	std::condition_variable requestsDone; ///< Producers wait for completion
+	std::atomic<bool> running{false};
+	std::atomic<bool> stopping{false};
+};
+
+} // namespace Storage::SD
+
+#endif
@@ -0,0 +1,252 @@
+#include <Storage/SD/Card.h>
+#include <Storage/Disk/SectorBuffer.h>
+#include <SmingTest.h>
+#include <algorithm>
+#include "common.h"
+
+using namespace Storage::SD;
+
+class AsyncTest : public TestGroup
+{
+public:
+	AsyncTest()
+		: TestGroup(_F("Async")), card("async", getCardSpi()), buffer1(card.getSectorSize(), SECTOR_COUNT),
+		  buffer2(card.getSectorSize(), SECTOR_COUNT)
+	{
+		REQUIRE(Storage::registerDevice(&card));
+	}
+
+	void execute() override
+	{
+		REQUIRE(card.begin(PIN_CARD_CS));
+
+		REQUIRE(buffer1 && buffer2);
+		const auto sectorSize = card.getSectorSize();
+
+		offset = (os_random() % (card.getSectorCount() - SECTOR_COUNT)) * sectorSize;
+
+		TEST_CASE("Invalid requests")
+		{
+			REQUIRE(!card.submitRead(offset + 1, buffer1.get(), sectorSize, nullptr));
+			REQUIRE(!card.submitRead(offset, buffer1.get(), sectorSize + 1, nullptr));
+			REQUIRE(!card.submitWrite(card.getSize(), buffer1.get(), sectorSize, nullptr));
+			REQUIRE_EQ(card.getPendingRequests(), 0);
+		}
+
+		TEST_CASE("Sync completes queued requests")
+		{
+			os_get_random(buffer1.get(), buffer1.size());
+			bool done{false};
+			REQUIRE(card.submitWrite(offset, buffer1.get(), buffer1.size(), [&](bool success) { done = success; }));
+			REQUIRE_EQ(card.getPendingRequests(), 1);
+			REQUIRE(card.sync());
+			REQUIRE(done);
+			REQUIRE_EQ(card.getPendingRequests(), 0);
+			buffer2.clear();
+			REQUIRE(card.read(offset, buffer2.get(), buffer2.size()));
+			REQUIRE(buffer1 == buffer2);
+		}
+
+		TEST_CASE("Elevator scheduling")
+		{
+			// Single-sector writes submitted in reverse order are merged into multiple block writes
+			os_get_random(buffer1.get(), buffer1.size());
+			SD_METRICS(auto merged = card.getMetrics().mergedRequests;)
+			unsigned completed{0};
+			for(unsigned i = SECTOR_COUNT; i-- != 0;) {
+				REQUIRE(card.submitWrite(offset + i * sectorSize, buffer1.get() + i * sectorSize, sectorSize,
+										 [&](bool success) { completed += success; }));
+			}
+			REQUIRE(card.sync());
+			REQUIRE_EQ(completed, SECTOR_COUNT);
+			SD_METRICS(REQUIRE(card.getMetrics().mergedRequests - merged >= SECTOR_COUNT / 2);)
+
+			// High priority read overtakes a bulk read which was queued first
+			String order;
+			buffer2.clear();
+			REQUIRE(card.submitRead(offset, buffer2.get(), buffer2.size() - sectorSize,
+									[&](bool success) { order += success ? 'N' : 'n'; }));
+			auto last = buffer2.size() - sectorSize;
+			REQUIRE(card.submitRead(
+				offset + last, buffer2.get() + last, sectorSize, [&](bool success) { order += success ? 'H' : 'h'; },
+				Card::Priority::high));
+			REQUIRE(card.sync());
+			REQUIRE_EQ(order, "HN");
+			REQUIRE(buffer1 == buffer2);
+
+			// Overlapping write is never reordered ahead of an earlier read
+			order = "";
+			buffer2.clear();
+			Storage::Disk::SectorBuffer data(sectorSize, 1);
+			os_get_random(data.get(), data.size());
+			REQUIRE(card.submitRead(offset, buffer2.get(), buffer2.size(),
+									[&](bool success) { order += success ? 'R' : 'r'; }));
+			REQUIRE(card.submitWrite(
+				offset + last, data.get(), sectorSize, [&](bool success) { order += success ? 'W' : 'w'; },
+				Card::Priority::high));
+			REQUIRE(card.sync());
+			REQUIRE_EQ(order, "RW");
+			REQUIRE(buffer1 == buffer2);
+			REQUIRE(card.read(offset + last, buffer2.get(), sectorSize));
+			REQUIRE(memcmp(buffer2.get(), data.get(), sectorSize) == 0);
+			memcpy(buffer1.get() + last, data.get(), sectorSize);
+		}
+
+		TEST_CASE("Burst write")
+		{
+			os_get_random(buffer1.get(), buffer1.size());
+#if SD_ENABLE_METRICS
+			auto& cmd25 = card.getMetrics().commands[unsigned(Metrics::Command::CMD25)];
+			auto writeCount = cmd25.count;
+#endif
+			bool done{false};
+			REQUIRE(card.submitBurst(offset, buffer1.get(), buffer1.size(), [&](bool success) { done = success; }));
+			REQUIRE(card.sync());
+			REQUIRE(done);
+			// Not split into chunks
+			SD_METRICS(REQUIRE_EQ(cmd25.count - writeCount, 1);)
+			buffer2.clear();
+			REQUIRE(card.read(offset, buffer2.get(), buffer2.size()));
+			REQUIRE(buffer1 == buffer2);
+		}
+
+		TEST_CASE("Discard")
+		{
+			// Range covering one complete erase unit with two sectors either side, at end of card
+			const auto unitSize = card.getBlockSize();
+			const auto unitSectors = unitSize / sectorSize;
+			const storage_size_t unit = (card.getSize() / unitSize) - 2;
+			const auto start = unit * unitSize - 2 * sectorSize;
+			const auto size = unitSize + 4 * sectorSize;
+			const uint8_t erased = card.scr.data_stat_after_erase() ? 0xff : 0x00;
+
+			auto sectorErased = [&](storage_size_t sector) {
+				auto buf = buffer2.get();
+				REQUIRE(card.read(sector * sectorSize, buf, sectorSize));
+				return std::all_of(buf, buf + sectorSize, [&](uint8_t c) { return c == erased; });
+			};
+
+			auto prepare = [&]() {
+				for(auto sector : {unit * unitSectors - 2, unit * unitSectors, (unit + 1) * unitSectors + 1}) {
+					os_get_random(buffer1.get(), sectorSize * 2);
+					REQUIRE(card.write(sector * sectorSize, buffer1.get(), sectorSize * 2));
+				}
+			};
+
+			prepare();
+			card.setDiscardPolicy(Card::DiscardPolicy::skip);
+			bool done{false};
+			REQUIRE(card.submitDiscard(start, size, [&](bool success) { done = success; }));
+			REQUIRE(card.sync());
+			REQUIRE(done);
+			REQUIRE(!sectorErased(unit * unitSectors - 1));
+			REQUIRE(sectorErased(unit * unitSectors));
+			REQUIRE(sectorErased((unit + 1) * unitSectors - 1));
+			REQUIRE(!sectorErased((unit + 1) * unitSectors + 1));
+
+			prepare();
+			card.setDiscardPolicy(Card::DiscardPolicy::write);
+			done = false;
+			REQUIRE(card.submitDiscard(start, size, [&](bool success) { done = success; }));
+			REQUIRE(card.sync());
+			REQUIRE(done);
+			REQUIRE(sectorErased(unit * unitSectors - 2));
+			REQUIRE(sectorErased(unit * unitSectors));
+			REQUIRE(sectorErased((unit + 1) * unitSectors + 1));
+			card.setDiscardPolicy(Card::DiscardPolicy::skip);
+		}
+
+		TEST_CASE("Write then read back")
+		{
+			os_get_random(buffer1.get(), buffer1.size());
+			buffer2.clear();
+			REQUIRE(card.submitWrite(offset, buffer1.get(), buffer1.size(), [this](bool success) {
+				REQUIRE(success);
+				REQUIRE_EQ(++callbackCount, 1);
+			}));
+			REQUIRE(card.submitRead(offset, buffer2.get(), buffer2.size(), [this](bool success) {
+				REQUIRE(success);
+				REQUIRE_EQ(++callbackCount, 2);
+				REQUIRE(buffer1 == buffer2);
+				Serial << "Async requests complete" << endl;
+				readAheadTest();
+			}));
+			REQUIRE_EQ(card.getPendingRequests(), 2);
+			// Nothing happens until we return to the task queue
+			REQUIRE_EQ(callbackCount, 0);
+			pending();
+		}
+	}
+
+private:
+	/*
+	 * Sectors following a streamed read are fetched from the task queue
+	 */
+	void readAheadTest()
+	{
+		TEST_CASE("Read ahead")
+		{
+			REQUIRE(card.setReadStream(true, READ_AHEAD_SECTORS));
+			buffer2.clear();
+			const auto sectorSize = card.getSectorSize();
+			REQUIRE(card.read(offset, buffer2.get(), sectorSize));
+			REQUIRE(card.read(offset + sectorSize, buffer2.get() + sectorSize, sectorSize));
+			System.queueCallback([this]() {
+				// Served from read-ahead buffer, then the open session
+				REQUIRE(card.read(offset + 2 * card.getSectorSize(), buffer2.get() + 2 * card.getSectorSize(),
+								  buffer2.size() - 2 * card.getSectorSize()));
+				REQUIRE(buffer1 == buffer2);
+				card.setReadStream(false);
+				destroyTest();
+			});
+		}
+	}
+
+	/*
+	 * Destroying a card must cancel its queued tasks
+	 */
+	void destroyTest()
+	{
+		TEST_CASE("Destroy with tasks pending")
+		{
+			// Emulator is re-initialised, so stop using the main card
+			card.end();
+			const auto sectorSize = card.getSectorSize();
+			auto tmp = new Card("tmp", getCardSpi());
+			REQUIRE(tmp->begin(PIN_CARD_CS));
+			REQUIRE(tmp->setReadStream(true, READ_AHEAD_SECTORS));
+			// Second read follows on from the first, so opens a session and queues read-ahead
+			REQUIRE(tmp->read(offset, buffer2.get(), sectorSize));
+			REQUIRE(tmp->read(offset + sectorSize, buffer2.get(), sectorSize));
+			REQUIRE(tmp->isReadAheadQueued());
+			REQUIRE(tmp->submitRead(offset + 2 * sectorSize, buffer2.get(), sectorSize, nullptr));
+			REQUIRE_EQ(tmp->getPendingRequests(), 1);
+			delete tmp;
+
+			// Destroying a task disarms its queued callback
+			auto task = new QueuedTask([](void* param) { *static_cast<bool*>(param) = true; }, &taskRan);
+			REQUIRE(task->queue());
+			REQUIRE(task->isQueued());
+			delete task;
+
+			System.queueCallback([this]() {
+				REQUIRE(!taskRan);
+				complete();
+			});
+		}
+	}
+
+	static constexpr size_t SECTOR_COUNT{40};
+	static constexpr size_t READ_AHEAD_SECTORS{8};
+	Card card;
+	Storage::Disk::SectorBuffer buffer1;
+	Storage::Disk::SectorBuffer buffer2;
+	storage_size_t offset{0};
+	unsigned callbackCount{0};
+	bool taskRan{false};
+};
+
+void REGISTER_TEST(async)
+{
+	registerGroup<AsyncTest>();
+}
@@ -1,5 +1,8 @@
 #include <Storage/SD/CSD.h>
 #include <Storage/SD/CID.h>
+#include <Storage/SD/SwitchStatus.h>
+#include <Storage/SD/SSR.h>
+#include <Storage/SD/SCR.h>
 #include <SmingTest.h>
 
 using namespace Storage::SD;
@@ -35,6 +38,8 @@ public:
 			REQUIRE_EQ(csd.taac(), 14);
 			REQUIRE_EQ(csd.nsac(), 0);
 			REQUIRE_EQ(csd.tran_speed(), 50);
+			REQUIRE_EQ(csd.getTransferRate(), 25000000);
+			REQUIRE_EQ(csd.getAccessTime(25000000), 1000000);
 			REQUIRE_EQ(csd.ccc(), 1461);
 			REQUIRE_EQ(csd.read_bl_len(), 9);
 			REQUIRE_EQ(csd.read_bl_partial(), 0);
@@ -59,6 +64,81 @@ public:
 			REQUIRE_EQ(csd.crc(), 42);
 		}
 
+		TEST_CASE("Switch status")
+		{
+			// Response to CMD6 check for high-speed mode
+			uint8_t data[64]{0x00, 0x64, 0x80, 0x01, 0x80, 0x01, 0x80, 0x01, 0x80,
+							 0x01, 0x80, 0x01, 0x80, 0x03, 0x00, 0x00, 0x01, 0x01};
+			static_assert(sizeof(data) == sizeof(SwitchStatus));
+
+			SwitchStatus status;
+			memcpy(&status, data, sizeof(data));
+			status.bswap();
+
+			Serial << status << endl;
+
+			REQUIRE_EQ(status.max_current(), 100);
+			REQUIRE_EQ(status.group6_support(), 0x8001);
+			REQUIRE_EQ(status.group2_support(), 0x8001);
+			REQUIRE_EQ(status.group1_support(), 0x8003);
+			REQUIRE_EQ(status.group6_result(), 0);
+			REQUIRE_EQ(status.group1_result(), 1);
+			REQUIRE_EQ(status.structure_version(), 1);
+			REQUIRE_EQ(status.group1_busy(), 0);
+			REQUIRE(status.supports(SwitchStatus::AccessMode::highSpeed));
+		}
+
+		TEST_CASE("SSR")
+		{
+			uint8_t data[64]{0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x04,
+							 0x00, 0x90, 0x00, 0x08, 0x16, 0x19, 0x0a, 0x00, 0x00};
+			static_assert(sizeof(data) == sizeof(SSR));
+
+			SSR ssr;
+			memcpy(&ssr, data, sizeof(data));
+			ssr.bswap();
+
+			Serial << ssr << endl;
+
+			REQUIRE_EQ(ssr.dat_bus_width(), 0);
+			REQUIRE_EQ(ssr.size_of_protected_area(), 0x50000);
+			REQUIRE_EQ(ssr.speed_class(), 4);
+			REQUIRE_EQ(ssr.au_size(), 9);
+			REQUIRE_EQ(ssr.erase_size(), 8);
+			REQUIRE_EQ(ssr.erase_timeout(), 5);
+			REQUIRE_EQ(ssr.erase_offset(), 2);
+			REQUIRE_EQ(ssr.uhs_speed_grade(), 1);
+			REQUIRE_EQ(ssr.uhs_au_size(), 9);
+			REQUIRE_EQ(ssr.video_speed_class(), 10);
+			REQUIRE_EQ(ssr.getAllocationUnitSize(), 4 * 1024 * 1024);
+			REQUIRE_EQ(ssr.getSpeedClass(), 10);
+			REQUIRE_EQ(ssr.getEraseTimeout(16), 12000);
+		}
+
+		TEST_CASE("SCR")
+		{
+			uint8_t data[]{0x02, 0x35, 0x80, 0x03, 0x00, 0x00, 0x00, 0x00};
+			static_assert(sizeof(data) == sizeof(SCR));
+
+			SCR scr;
+			memcpy(&scr, data, sizeof(data));
+			scr.bswap();
+
+			Serial << scr << endl;
+
+			REQUIRE_EQ(scr.scr_structure(), 0);
+			REQUIRE_EQ(scr.sd_spec(), 2);
+			REQUIRE_EQ(scr.data_stat_after_erase(), 0);
+			REQUIRE_EQ(scr.sd_security(), 3);
+			REQUIRE_EQ(scr.sd_bus_widths(), 5);
+			REQUIRE_EQ(scr.sd_spec3(), 1);
+			REQUIRE_EQ(scr.ex_security(), 0);
+			REQUIRE_EQ(scr.sd_spec4(), 0);
+			REQUIRE_EQ(scr.sd_specx(), 0);
+			REQUIRE_EQ(scr.cmd_support(), 3);
+			REQUIRE(scr.supportsSetBlockCount());
+		}
+
 		TEST_CASE("CID")
 		{
 			/*
@@ -0,0 +1,145 @@
+#include <Storage/SD/Card.h>
+#include <Storage/Disk/SectorBuffer.h>
+#include <SmingTest.h>
+#include "common.h"
+#include "SpiMonitor.h"
+
+using namespace Storage::SD;
+
+/*
+ * Results are output as CSV rows prefixed with 'bench', e.g.:
+ *
+ *   bench,op,sectors,requests,us,MB/s,IOPS,spiBytes/req,commands/req,overhead%
+ *   bench,seqRead,16,32,12345,...
+ *
+ * Random addresses are generated from a fixed seed so that byte and command counts
+ * are repeatable between runs.
+ */
+
+#define BENCHMARK_OP_MAP(XX)                                                                                           \
+	XX(seqRead)                                                                                                        \
+	XX(seqWrite)                                                                                                       \
+	XX(streamRead)                                                                                                     \
+	XX(streamWrite)                                                                                                    \
+	XX(randRead)                                                                                                       \
+	XX(randWrite)                                                                                                      \
+	XX(mixed)                                                                                                          \
+	XX(erase)
+
+class BenchmarkTest : public TestGroup
+{
+public:
+	enum class Op {
+#define XX(tag) tag,
+		BENCHMARK_OP_MAP(XX)
+#undef XX
+	};
+
+	BenchmarkTest() : TestGroup(_F("Benchmark")), monitor(getCardSpi()), card("bench", monitor)
+	{
+		REQUIRE(Storage::registerDevice(&card));
+	}
+
+	void execute() override
+	{
+		REQUIRE(card.begin(PIN_CARD_CS));
+
+		Serial << "bench,op,sectors,requests,us,MB/s,IOPS,spiBytes/req,commands/req,overhead%" << endl;
+
+		const size_t sizes[]{1, 4, 16, 64, 256};
+		for(auto sectors : sizes) {
+			Storage::Disk::SectorBuffer buffer(card.getSectorSize(), sectors);
+			if(!buffer) {
+				Serial << "# Skipping " << sectors << "-sector requests, insufficient memory" << endl;
+				continue;
+			}
+			os_get_random(buffer.get(), buffer.size());
+
+#define XX(tag) run(Op::tag, F(#tag), sectors, buffer);
+			BENCHMARK_OP_MAP(XX)
+#undef XX
+		}
+	}
+
+private:
+	void run(Op op, const String& name, size_t sectors, Storage::Disk::SectorBuffer& buffer)
+	{
+		const auto sectorSize = card.getSectorSize();
+		const size_t requestSize = sectors * sectorSize;
+		const unsigned requests = std::max(size_t(4), 512 / sectors);
+		const storage_size_t randomRange = card.getSectorCount() - sectors;
+		// Sequential tests use a region in the middle of the card
+		storage_size_t sector = card.getSectorCount() / 2;
+
+		// Sequential transfers using open-ended sessions
+		card.setReadStream(op == Op::streamRead);
+		card.setWriteStream(op == Op::streamWrite, sectors * requests);
+
+		seed = 0x5d5d5d5d;
+		monitor.resetStats();
+		bool ok{true};
+		auto startTime = micros();
+
+		for(unsigned i = 0; ok && i < requests; ++i) {
+			bool isRandom = (op == Op::randRead || op == Op::randWrite || op == Op::mixed);
+			if(isRandom) {
+				sector = random() % randomRange;
+			}
+			auto offset = storage_size_t(sector) * sectorSize;
+			switch(op) {
+			case Op::seqRead:
+			case Op::streamRead:
+			case Op::randRead:
+				ok = card.read(offset, buffer.get(), requestSize);
+				break;
+			case Op::seqWrite:
+			case Op::streamWrite:
+			case Op::randWrite:
+				ok = card.write(offset, buffer.get(), requestSize);
+				break;
+			case Op::mixed:
+				ok = (i & 1) ? card.write(offset, buffer.get(), requestSize)
+							 : card.read(offset, buffer.get(), requestSize);
+				break;
+			case Op::erase:
+				ok = card.erase_range(offset, requestSize);
+				break;
+			}
+			if(!isRandom) {
+				sector += sectors;
+			}
+		}
+		CHECK(card.sync());
+		card.setReadStream(false);
+		card.setWriteStream(false);
+
+		auto elapsed = std::max(micros() - startTime, uint32_t(1));
+		CHECK(ok);
+
+		auto& stats = monitor.getStats();
+		uint64_t payload = (op == Op::erase) ? 0 : uint64_t(requestSize) * requests;
+		uint64_t dataSize = uint64_t(requestSize) * requests;
+		Serial << "bench," << name << ',' << sectors << ',' << requests << ',' << elapsed << ','
+			   << double(dataSize) / elapsed << ',' << double(requests) * 1000000 / elapsed << ','
+			   << stats.bytes / requests << ',' << double(stats.commands) / requests << ','
+			   << (stats.bytes ? 100.0 * (stats.bytes - payload) / stats.bytes : 0) << endl;
+	}
+
+	// xorshift32
+	uint32_t random()
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+	SpiMonitor monitor;
+	Card card;
+	uint32_t seed;
+};
+
+void REGISTER_TEST(benchmark)
+{
+	registerGroup<BenchmarkTest>();
+}
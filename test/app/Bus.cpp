@@ -0,0 +1,163 @@
+#include <Storage/SD/Card.h>
+#include <Storage/Disk/SectorBuffer.h>
+#include <SmingTest.h>
+#include "common.h"
+
+using namespace Storage::SD;
+
+/**
+ * @brief Another device sharing the bus, such as an ADC, with its own clock settings
+ *
+ * No data is transferred as the emulator does not monitor chip select.
+ */
+class Peripheral : public SpiBus::Client
+{
+public:
+	Peripheral(SpiBus& bus) : bus(bus)
+	{
+	}
+
+	~Peripheral()
+	{
+		end();
+	}
+
+	bool begin()
+	{
+		attached = bus.attach();
+		return attached;
+	}
+
+	void end()
+	{
+		if(attached) {
+			bus.detach(*this);
+			attached = false;
+		}
+	}
+
+	bool transaction()
+	{
+		if(!bus.acquire(*this, settings)) {
+			return false;
+		}
+		bus.release(*this);
+		return true;
+	}
+
+	bool yieldBus() override
+	{
+		// Bus is only held during a transaction
+		return false;
+	}
+
+	SPISettings settings{2000000, MSBFIRST, SPI_MODE3};
+
+private:
+	SpiBus& bus;
+	bool attached{false};
+};
+
+class BusTest : public TestGroup
+{
+public:
+	BusTest()
+		: TestGroup(_F("Bus")), bus(getCardSpi()), card("bus", bus), peripheral(bus),
+		  data(card.getSectorSize(), SECTOR_COUNT), readback(card.getSectorSize(), SECTOR_COUNT)
+	{
+		REQUIRE(Storage::registerDevice(&card));
+	}
+
+	void execute() override
+	{
+#ifdef ARCH_HOST
+		getCardSpi().resetStats();
+#endif
+		REQUIRE(card.begin(PIN_CARD_CS));
+		REQUIRE(data && readback);
+		REQUIRE(peripheral.begin());
+		REQUIRE_EQ(bus.getClientCount(), 2);
+
+		const auto sectorSize = card.getSectorSize();
+		const auto offset = (os_random() % (card.getSectorCount() - SECTOR_COUNT)) * sectorSize;
+		os_get_random(data.get(), data.size());
+
+		TEST_CASE("Interleaved transactions")
+		{
+			for(unsigned i = 0; i < SECTOR_COUNT; ++i) {
+				auto address = offset + i * sectorSize;
+				REQUIRE(card.write(address, data.get() + i * sectorSize, sectorSize));
+				REQUIRE(peripheral.transaction());
+				REQUIRE(card.read(address, readback.get() + i * sectorSize, sectorSize));
+				checkFrequency();
+			}
+			REQUIRE(data == readback);
+		}
+
+		TEST_CASE("Open sessions yield bus")
+		{
+			const auto half = data.size() / 2;
+
+			card.setWriteStream(true, 0, 0);
+			REQUIRE(card.write(offset, data.get(), half));
+			REQUIRE(peripheral.transaction());
+			REQUIRE(card.write(offset + half, data.get() + half, half));
+			card.setWriteStream(false);
+
+			readback.clear();
+			REQUIRE(card.setReadStream(true));
+			REQUIRE(card.read(offset, readback.get(), half));
+			REQUIRE(peripheral.transaction());
+			REQUIRE(card.read(offset + half, readback.get() + half, half));
+			REQUIRE(card.setReadStream(false));
+			checkFrequency();
+			REQUIRE(data == readback);
+		}
+
+		TEST_CASE("Streaming read holds bus")
+		{
+			unsigned refused{0};
+			REQUIRE(card.readTo(offset, data.size(), [&](const uint8_t*, size_t) {
+				refused += !peripheral.transaction();
+				return true;
+			}));
+			REQUIRE_EQ(refused, SECTOR_COUNT);
+			REQUIRE(peripheral.transaction());
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+			checkFrequency();
+		}
+
+		TEST_CASE("Detach keeps controller active for others")
+		{
+			card.end();
+			REQUIRE_EQ(bus.getClientCount(), 1);
+			REQUIRE(peripheral.transaction());
+			peripheral.end();
+			REQUIRE_EQ(bus.getClientCount(), 0);
+		}
+	}
+
+	/*
+	 * Controller must be set to card's clock after another device has used the bus
+	 */
+	void checkFrequency()
+	{
+#ifdef ARCH_HOST
+		REQUIRE_EQ(getCardSpi().getFrequency(), card.getFrequency());
+		REQUIRE_EQ(getCardSpi().getStats().clockErrors, 0);
+#endif
+	}
+
+private:
+	static constexpr unsigned SECTOR_COUNT{16};
+	SpiBus bus;
+	Card card;
+	Peripheral peripheral;
+	Storage::Disk::SectorBuffer data;
+	Storage::Disk::SectorBuffer readback;
+};
+
+void REGISTER_TEST(bus)
+{
+	registerGroup<BusTest>();
+}
@@ -2,21 +2,14 @@
 #include <Storage/Disk/SectorBuffer.h>
 #include <Storage/Disk/PartInfo.h>
 #include <SmingTest.h>
-
-// Chip selects independent of SPI controller in use
-#ifdef ARCH_ESP32
-#define PIN_CARD_CS 21
-#else
-// Esp8266 cannot use GPIO15 as this affects boot mode
-#define PIN_CARD_CS 5
-#endif
+#include "common.h"
 
 using namespace Storage::SD;
 
 class CommandTest : public TestGroup
 {
 public:
-	CommandTest() : TestGroup(_F("Commands")), card("card1", SPI)
+	CommandTest() : TestGroup(_F("Commands")), card("card1", getCardSpi())
 	{
 		REQUIRE(Storage::registerDevice(&card));
 	}
@@ -31,10 +24,36 @@ public:
 
 		Serial << "CSD" << endl << card.csd << endl;
 		Serial << "CID" << endl << card.cid;
+		Serial << "SSR" << endl << card.ssr << endl;
+		Serial << "SCR" << endl << card.scr << endl;
+		Serial << "Block size " << card.getBlockSize() << endl;
 		for(auto part : card.partitions()) {
 			Serial << part << endl;
 		}
 
+		TEST_CASE("Clock setup")
+		{
+			bool highSpeed = (card.getAccessMode() == Card::AccessMode::highSpeed);
+			Serial << "SPI clock " << card.getFrequency() << " Hz, " << (highSpeed ? "high" : "default")
+				   << " speed" << endl;
+			REQUIRE(card.getFrequency() > 400000);
+			// No frequency limit given so card is clocked at the rate it reports, re-read after any mode switch
+			if(card.csd.getTransferRate() != 0) {
+				REQUIRE_EQ(card.getFrequency(), card.csd.getTransferRate());
+			}
+#ifdef ARCH_HOST
+			REQUIRE_EQ(getCardSpi().getStats().clockErrors, 0);
+#endif
+		}
+
+		TEST_CASE("Timeouts")
+		{
+			Serial << "Read timeout " << card.getReadTimeout() << " us, write timeout " << card.getWriteTimeout()
+				   << " us" << endl;
+			REQUIRE(card.getReadTimeout() != 0 && card.getReadTimeout() <= 100000);
+			REQUIRE(card.getWriteTimeout() >= card.getReadTimeout() && card.getWriteTimeout() <= 500000);
+		}
+
 		const auto sectorSize = card.getSectorSize();
 		const auto sectorCount = card.getSectorCount();
 
@@ -73,6 +92,306 @@ public:
 				REQUIRE(buffer1 == buffer2);
 			}
 		}
+
+		TEST_CASE("Closed-ended transfers")
+		{
+			auto offset = (os_random() % (sectorCount - SECTOR_COUNT)) * sectorSize;
+#ifdef ARCH_HOST
+			auto& stats = getCardSpi().getStats();
+			auto stopCount = stats.cmd[12];
+			auto blockCountCount = stats.cmd[23];
+#endif
+			os_get_random(buffer1.get(), bufSize);
+			REQUIRE(card.write(offset, buffer1.get(), bufSize));
+			buffer2.clear();
+			REQUIRE(card.read(offset, buffer2.get(), bufSize));
+			REQUIRE(buffer1 == buffer2);
+#ifdef ARCH_HOST
+			// Emulated SDHC card supports CMD23 so neither transfer needs stopping
+			REQUIRE(card.scr.supportsSetBlockCount());
+			REQUIRE_EQ(stats.cmd[23] - blockCountCount, 2);
+			REQUIRE_EQ(stats.cmd[12], stopCount);
+#endif
+		}
+
+		TEST_CASE("Scatter-gather")
+		{
+			auto offset = (os_random() % (sectorCount - SECTOR_COUNT)) * sectorSize;
+			os_get_random(buffer1.get(), bufSize);
+#if SD_ENABLE_METRICS
+			auto& metrics = card.getMetrics();
+			auto writeCount = metrics.commands[unsigned(Metrics::Command::CMD25)].count;
+			auto readCount = metrics.commands[unsigned(Metrics::Command::CMD18)].count;
+#endif
+
+			// Write contiguous sectors from separate buffers, in reverse order of memory
+			auto half = (SECTOR_COUNT / 2) * sectorSize;
+			const Segment writeSegments[]{
+				{buffer1.get() + half, sectorSize},
+				{buffer1.get() + half + sectorSize, bufSize - half - sectorSize},
+				{buffer1.get(), half},
+			};
+			REQUIRE(card.writev(offset, writeSegments, ARRAY_SIZE(writeSegments)));
+
+			buffer2.clear();
+			const MutableSegment readSegments[]{
+				{buffer2.get() + bufSize - half, half},
+				{buffer2.get(), bufSize - half},
+			};
+			REQUIRE(card.readv(offset, readSegments, ARRAY_SIZE(readSegments)));
+			REQUIRE(buffer1 == buffer2);
+#if SD_ENABLE_METRICS
+			REQUIRE_EQ(metrics.commands[unsigned(Metrics::Command::CMD25)].count - writeCount, 1);
+			REQUIRE_EQ(metrics.commands[unsigned(Metrics::Command::CMD18)].count - readCount, 1);
+#endif
+
+			const MutableSegment badSegments[]{{buffer2.get(), sectorSize + 1U}};
+			REQUIRE(!card.readv(offset, badSegments, ARRAY_SIZE(badSegments)));
+		}
+
+		TEST_CASE("Streaming read")
+		{
+			auto offset = (os_random() % (sectorCount - SECTOR_COUNT)) * sectorSize;
+			os_get_random(buffer1.get(), bufSize);
+			REQUIRE(card.write(offset, buffer1.get(), bufSize));
+
+			buffer2.clear();
+			size_t pos{0};
+			REQUIRE(card.readTo(offset, bufSize, [&](const uint8_t* block, size_t size) {
+				REQUIRE_EQ(size, sectorSize);
+				memcpy(buffer2.get() + pos, block, size);
+				pos += size;
+				return true;
+			}));
+			REQUIRE_EQ(pos, bufSize);
+			REQUIRE(buffer1 == buffer2);
+
+			// Abort after first block, card remains usable
+			unsigned blockCount{0};
+			REQUIRE(!card.readTo(offset, bufSize, [&](const uint8_t*, size_t) { return ++blockCount < 1; }));
+			REQUIRE_EQ(blockCount, 1);
+			buffer2.clear();
+			REQUIRE(card.read(offset, buffer2.get(), bufSize));
+			REQUIRE(buffer1 == buffer2);
+		}
+
+		TEST_CASE("Synchronous busy handling")
+		{
+			auto offset = (os_random() % (sectorCount - SECTOR_COUNT)) * sectorSize;
+			card.setDeferredBusy(false);
+
+			os_get_random(buffer1.get(), buffer1.size());
+			REQUIRE(card.write(offset, buffer1.get(), sectorSize));
+			REQUIRE(card.write(offset + sectorSize, buffer1.get() + sectorSize, bufSize - sectorSize));
+			buffer2.clear();
+			REQUIRE(card.read(offset, buffer2.get(), bufSize));
+			REQUIRE(buffer1 == buffer2);
+
+			REQUIRE(card.erase_range(offset, bufSize));
+			REQUIRE(card.sync());
+
+			card.setDeferredBusy(true);
+		}
+
+		TEST_CASE("Read stream")
+		{
+			static constexpr size_t STREAM_SECTORS{SECTOR_COUNT * 4};
+			Storage::Disk::SectorBuffer data(sectorSize, STREAM_SECTORS);
+			Storage::Disk::SectorBuffer readback(sectorSize, STREAM_SECTORS);
+			REQUIRE(data && readback);
+			os_get_random(data.get(), data.size());
+			auto offset = (os_random() % (sectorCount - STREAM_SECTORS)) * sectorSize;
+			REQUIRE(card.write(offset, data.get(), data.size()));
+
+			REQUIRE(card.setReadStream(true));
+			readback.clear();
+			// Sequential reads of varying size continue the same session
+			const size_t counts[]{1, 1, 3, 2, 5};
+			size_t pos{0};
+			for(auto count : counts) {
+				REQUIRE(card.read(offset + pos * sectorSize, readback.get() + pos * sectorSize, count * sectorSize));
+				pos += count;
+			}
+			// A write ends the session
+			REQUIRE(card.write(offset + pos * sectorSize, data.get() + pos * sectorSize, sectorSize));
+			REQUIRE(card.read(offset + pos * sectorSize, readback.get() + pos * sectorSize, sectorSize));
+			++pos;
+			// Non-contiguous read
+			REQUIRE(card.read(offset, buffer2.get(), sectorSize));
+			REQUIRE(memcmp(buffer2.get(), data.get(), sectorSize) == 0);
+			auto remain = data.size() - pos * sectorSize;
+			REQUIRE(card.read(offset + pos * sectorSize, readback.get() + pos * sectorSize, remain));
+			REQUIRE(card.sync());
+			REQUIRE(data == readback);
+
+			card.setReadStream(false);
+		}
+
+		TEST_CASE("Write stream")
+		{
+			static constexpr size_t STREAM_SECTORS{SECTOR_COUNT * 4};
+			static constexpr size_t GUARD_SECTORS{4};
+			Storage::Disk::SectorBuffer data(sectorSize, STREAM_SECTORS + GUARD_SECTORS);
+			Storage::Disk::SectorBuffer readback(sectorSize, STREAM_SECTORS + GUARD_SECTORS);
+			REQUIRE(data && readback);
+			os_get_random(data.get(), data.size());
+			auto offset = (os_random() % (sectorCount - STREAM_SECTORS - GUARD_SECTORS)) * sectorSize;
+			const auto streamSize = STREAM_SECTORS * sectorSize;
+
+			// Sectors following the stream must not be pre-erased
+			REQUIRE(card.write(offset + streamSize, data.get() + streamSize, GUARD_SECTORS * sectorSize));
+
+#ifdef ARCH_HOST
+			auto preErased = getCardSpi().getStats().blocksPreErased;
+#endif
+			card.setWriteStream(true, STREAM_SECTORS);
+			// Contiguous writes of varying size continue the same session
+			const size_t counts[]{1, 1, 3, 2, 5};
+			size_t pos{0};
+			for(auto count : counts) {
+				REQUIRE(card.write(offset + pos * sectorSize, data.get() + pos * sectorSize, count * sectorSize));
+				pos += count;
+			}
+			// A read ends the session
+			REQUIRE(card.read(offset, readback.get(), pos * sectorSize));
+			REQUIRE(memcmp(data.get(), readback.get(), pos * sectorSize) == 0);
+#ifdef ARCH_HOST
+			// Emulator fills pre-erased sectors not written with a pattern
+			REQUIRE_EQ(getCardSpi().getStats().blocksPreErased - preErased, STREAM_SECTORS - pos);
+#endif
+			// Out of order writes start new sessions, without pre-erasing sectors already written
+			auto remain = streamSize - pos * sectorSize;
+			REQUIRE(card.write(offset + pos * sectorSize + sectorSize, data.get() + pos * sectorSize + sectorSize,
+							   remain - sectorSize));
+			REQUIRE(card.write(offset + pos * sectorSize, data.get() + pos * sectorSize, sectorSize));
+			REQUIRE(card.sync());
+			card.setWriteStream(false);
+#ifdef ARCH_HOST
+			REQUIRE_EQ(getCardSpi().getStats().blocksPreErased - preErased, STREAM_SECTORS - pos);
+#endif
+
+			readback.clear();
+			REQUIRE(card.read(offset, readback.get(), readback.size()));
+			REQUIRE(data == readback);
+		}
+
+		TEST_CASE("Write-back cache")
+		{
+			static constexpr size_t CACHE_SECTORS{SECTOR_COUNT * 2};
+			Storage::Disk::SectorBuffer data(sectorSize, CACHE_SECTORS);
+			Storage::Disk::SectorBuffer readback(sectorSize, CACHE_SECTORS);
+			os_get_random(data.get(), data.size());
+			auto offset = (os_random() % (sectorCount - CACHE_SECTORS)) * sectorSize;
+
+#if SD_ENABLE_METRICS
+			auto& metrics = card.getMetrics();
+			auto getWriteCount = [&]() {
+				return metrics.commands[unsigned(Metrics::Command::CMD24)].count +
+					   metrics.commands[unsigned(Metrics::Command::CMD25)].count;
+			};
+			auto writeCount = getWriteCount();
+#endif
+
+			REQUIRE(card.setCacheSize(CACHE_SECTORS));
+			// Update each sector several times, in reverse order
+			for(unsigned pass = 0; pass < 3; ++pass) {
+				for(unsigned i = CACHE_SECTORS; i-- != 0;) {
+					REQUIRE(card.write(offset + i * sectorSize, data.get() + i * sectorSize, sectorSize));
+				}
+			}
+			// Cached sectors are returned for both single and multiple sector reads
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+			REQUIRE(card.read(offset + sectorSize, readback.get() + sectorSize, readback.size() - sectorSize));
+			REQUIRE(data == readback);
+			REQUIRE(card.sync());
+#if SD_ENABLE_METRICS
+			// All sectors written back in a single contiguous run
+			REQUIRE_EQ(getWriteCount() - writeCount, 1);
+			REQUIRE(metrics.cacheHits != 0);
+#endif
+			REQUIRE(card.setCacheSize(0));
+
+			readback.clear();
+			REQUIRE(card.read(offset, readback.get(), readback.size()));
+			REQUIRE(data == readback);
+		}
+
+		TEST_CASE("Pinned sectors")
+		{
+			Storage::Disk::SectorBuffer data(sectorSize, SECTOR_COUNT);
+			Storage::Disk::SectorBuffer readback(sectorSize, SECTOR_COUNT);
+			os_get_random(data.get(), data.size());
+			auto sector = os_random() % (sectorCount - SECTOR_COUNT * 2);
+			auto offset = sector * sectorSize;
+			REQUIRE(card.write(offset, data.get(), data.size()));
+
+			REQUIRE(card.setCacheSize(SECTOR_COUNT));
+			REQUIRE(card.pinSectors(sector, SECTOR_COUNT - 1));
+			REQUIRE(!card.pinSectors(sector + SECTOR_COUNT, 1));
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+
+			// Reading other sectors evicts only unpinned entries
+			for(unsigned i = 0; i < SECTOR_COUNT; ++i) {
+				REQUIRE(card.read(offset + (SECTOR_COUNT + i) * sectorSize, readback.get(), sectorSize));
+			}
+#if SD_ENABLE_METRICS
+			auto& metrics = card.getMetrics();
+			auto hits = metrics.cacheHits;
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+			REQUIRE_EQ(metrics.cacheHits, hits + 1);
+#endif
+
+			// Cached copies follow writes and erasures
+			os_get_random(data.get(), data.size());
+			REQUIRE(card.write(offset, data.get(), data.size()));
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+			REQUIRE(memcmp(data.get(), readback.get(), sectorSize) == 0);
+			REQUIRE(card.erase_range(offset, data.size()));
+			REQUIRE(card.read(offset, readback.get(), sectorSize));
+			REQUIRE(card.setCacheSize(0));
+			REQUIRE(card.read(offset, data.get(), sectorSize));
+			REQUIRE(memcmp(data.get(), readback.get(), sectorSize) == 0);
+		}
+
+#ifdef ARCH_HOST
+		TEST_CASE("Pin failure")
+		{
+			// Card stays busy for longer than write timeout, so write-back fails
+			auto& emulator = getCardSpi();
+			auto timing = emulator.timing;
+			emulator.timing.writeBusyUs = card.getWriteTimeout() * 2;
+
+			constexpr size_t CACHE_SECTORS{4};
+			auto sector = os_random() % (sectorCount - CACHE_SECTORS * 4);
+			REQUIRE(card.setCacheSize(CACHE_SECTORS));
+			// Two dirty entries, in separate runs
+			REQUIRE(card.write(sector * sectorSize, buffer1.get(), sectorSize));
+			REQUIRE(card.write((sector + 2) * sectorSize, buffer1.get(), sectorSize));
+			// Third entry requires an eviction
+			REQUIRE(!card.pinSectors(sector + CACHE_SECTORS, 3));
+
+			emulator.timing = timing;
+			REQUIRE(card.sync());
+			// Entries pinned before the failure were released
+			REQUIRE(card.pinSectors(sector + CACHE_SECTORS * 2, 3));
+			REQUIRE(card.setCacheSize(0));
+		}
+#endif
+
+		TEST_CASE("Metrics")
+		{
+			Serial << card.getMetrics();
+#if SD_ENABLE_METRICS
+			auto& metrics = card.getMetrics();
+			REQUIRE(metrics.bytesRead != 0);
+			REQUIRE(metrics.bytesWritten != 0);
+			REQUIRE(metrics.commands[unsigned(Metrics::Command::CMD17)].count != 0);
+			REQUIRE(metrics.commands[unsigned(Metrics::Command::other)].count != 0);
+			REQUIRE(metrics.batchedCommands != 0);
+			REQUIRE_EQ(metrics.tokenTimeouts, 0);
+			REQUIRE_EQ(metrics.dataRejects, 0);
+#endif
+		}
 	}
 
 private:
@@ -0,0 +1,199 @@
+#include <Storage/SD/RingLog.h>
+#include <Storage/Disk/SectorBuffer.h>
+#include <SmingTest.h>
+#include "common.h"
+
+using namespace Storage::SD;
+
+class RingLogTest : public TestGroup
+{
+public:
+	RingLogTest() : TestGroup(_F("RingLog")), card("ringlog", getCardSpi())
+	{
+		REQUIRE(Storage::registerDevice(&card));
+	}
+
+	void execute() override
+	{
+		REQUIRE(card.begin(PIN_CARD_CS));
+
+		// Three allocation units, clear of areas used by other tests
+		const auto unitSize = card.getBlockSize();
+		const auto unitSectors = unitSize / card.getSectorSize();
+		Storage::Partition::Info info(F("ringlog"), {Storage::Partition::Type::data, 0x80},
+									  (card.getSize() / unitSize - 6) * unitSize, 3 * unitSize);
+		Storage::Partition part(card, info);
+
+		TEST_CASE("Invalid partition")
+		{
+			Storage::Partition::Info badInfo(F("bad"), info.fullType, info.offset + card.getSectorSize(), unitSize);
+			RingLog log(Storage::Partition(card, badInfo));
+			REQUIRE(!log.format());
+			REQUIRE(!log.begin());
+		}
+
+		TEST_CASE("Append and recover")
+		{
+			RingLog log(part);
+			REQUIRE(log.format());
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), 0);
+			REQUIRE_EQ(log.getTail(), 0);
+
+			for(unsigned i = 0; i < RECORD_COUNT; ++i) {
+				auto s = makeRecord(i);
+				REQUIRE(log.append(s.c_str(), s.length()));
+			}
+			REQUIRE(log.flush());
+			checkRecords(log, 0, RECORD_COUNT);
+			log.end();
+
+			// Remount
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), RECORD_COUNT);
+			REQUIRE_EQ(log.getTail(), 0);
+			auto s = makeRecord(RECORD_COUNT);
+			REQUIRE(log.append(s.c_str(), s.length()));
+			// Buffered record not yet readable
+			Storage::Disk::SectorBuffer buf(card.getSectorSize(), 1);
+			size_t length;
+			REQUIRE(!log.read(RECORD_COUNT, buf.get(), length));
+			REQUIRE(log.flush());
+			checkRecords(log, 0, RECORD_COUNT + 1);
+		}
+
+		TEST_CASE("Format clears records")
+		{
+			RingLog log(part);
+			REQUIRE(log.begin());
+			REQUIRE(log.getHead() != 0);
+			log.end();
+
+#ifdef ARCH_HOST
+			// Discarded sectors may keep their contents, so every sector must be written
+			auto written = getCardSpi().getStats().blocksWritten;
+			REQUIRE(log.format());
+			REQUIRE(getCardSpi().getStats().blocksWritten - written >= part.size() / card.getSectorSize());
+#else
+			REQUIRE(log.format());
+#endif
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), 0);
+			REQUIRE_EQ(log.getTail(), 0);
+			Storage::Disk::SectorBuffer buf(card.getSectorSize(), 1);
+			size_t length;
+			REQUIRE(!log.read(0, buf.get(), length));
+		}
+
+		TEST_CASE("Append waits only for buffer in use")
+		{
+			RingLog log(part);
+			REQUIRE(log.format());
+			REQUIRE(log.begin(BUFFER_SECTORS));
+			// Fill both buffers then start a third burst without returning to the task queue
+			for(unsigned i = 0; i <= 2 * BUFFER_SECTORS; ++i) {
+				auto s = makeRecord(i);
+				REQUIRE(log.append(s.c_str(), s.length()));
+			}
+			// Second burst and pre-erase of next unit are still queued
+			REQUIRE(card.getPendingRequests() >= 2);
+			REQUIRE(log.flush());
+			REQUIRE_EQ(card.getPendingRequests(), 0);
+			checkRecords(log, 0, 2 * BUFFER_SECTORS + 1);
+		}
+
+		TEST_CASE("Recover after wrap")
+		{
+			RingLog log(part);
+			REQUIRE(log.format());
+
+			// Construct a log which has wrapped into the first unit, with the second unit erased
+			const uint32_t sectorCount = part.size() / card.getSectorSize();
+			for(unsigned i = 0; i < RECORD_COUNT; ++i) {
+				writeRecord(part, sectorCount + i);
+			}
+			writeRecord(part, 2 * unitSectors);
+			writeRecord(part, sectorCount - 1);
+
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), sectorCount + RECORD_COUNT);
+			REQUIRE_EQ(log.getTail(), 2 * unitSectors);
+			Storage::Disk::SectorBuffer buf(card.getSectorSize(), 1);
+			size_t length;
+			REQUIRE(log.read(2 * unitSectors, buf.get(), length));
+			REQUIRE_EQ(length, 0);
+			REQUIRE(log.read(sectorCount - 1, buf.get(), length));
+			REQUIRE(!log.read(unitSectors, buf.get(), length));
+			REQUIRE(log.format());
+		}
+
+		TEST_CASE("Sequence beyond 32 bits")
+		{
+			RingLog log(part);
+			REQUIRE(log.format());
+
+			// Construct a log whose newest record starts the unit before sequence 2^32
+			const uint32_t sectorCount = part.size() / card.getSectorSize();
+			const uint64_t wrapPoint{0x100000000ULL};
+			const uint64_t start = wrapPoint - unitSectors;
+			for(auto seq = start - start % sectorCount; seq <= start; seq += unitSectors) {
+				writeRecord(part, seq);
+			}
+
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), start + 1);
+			const uint64_t end = wrapPoint + RECORD_COUNT;
+			for(auto seq = start + 1; seq < end; ++seq) {
+				auto s = makeRecord(seq);
+				REQUIRE(log.append(s.c_str(), s.length()));
+			}
+			REQUIRE(log.flush());
+			log.end();
+
+			// Remount
+			REQUIRE(log.begin());
+			REQUIRE_EQ(log.getHead(), end);
+			REQUIRE(log.getTail() <= start + 1);
+			checkRecords(log, wrapPoint - RECORD_COUNT, end);
+		}
+	}
+
+private:
+	static String makeRecord(uint64_t index)
+	{
+		String s = F("Record #");
+		s += index;
+		return s;
+	}
+
+	/*
+	 * Write an empty record directly to the partition
+	 */
+	void writeRecord(Storage::Partition& part, uint64_t sequence)
+	{
+		const uint32_t sectorCount = part.size() / card.getSectorSize();
+		Storage::Disk::SectorBuffer buf(card.getSectorSize(), 1);
+		RingLog::Header header{RingLog::headerMagic, 0, 0, sequence};
+		memcpy(buf.get(), &header, sizeof(header));
+		REQUIRE(part.write(storage_size_t(sequence % sectorCount) * buf.size(), buf.get(), buf.size()));
+	}
+
+	void checkRecords(RingLog& log, uint64_t start, uint64_t end)
+	{
+		Storage::Disk::SectorBuffer buf(card.getSectorSize(), 1);
+		for(auto seq = start; seq < end; ++seq) {
+			size_t length;
+			REQUIRE(log.read(seq, buf.get(), length));
+			REQUIRE(makeRecord(seq) == String(reinterpret_cast<char*>(buf.get()), length));
+		}
+	}
+
+	static constexpr unsigned RECORD_COUNT{100};
+	static constexpr unsigned BUFFER_SECTORS{8};
+	Card card;
+};
+
+void REGISTER_TEST(ringlog)
+{
+	registerGroup<RingLogTest>();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Storage/SD/SPIExt.h>
+#include <algorithm>
+
+/**
+ * @brief Pass-through SPI interface which counts bus activity
+ *
+ * Commands are identified by their frame: `Card` always sends the 6-byte command
+ * packet (plus an optional trailing dummy byte) as a single transfer.
+ */
+class SpiMonitor : public Storage::SD::SPIExt
+{
+public:
+	struct Stats {
+		uint32_t bytes;	   ///< Total bytes clocked
+		uint32_t commands; ///< Number of command frames sent
+	};
+
+	SpiMonitor(SPIBase& spi) : SPIExt(spi.SPIDefaultSettings), spi(spi)
+	{
+	}
+
+	SpiMonitor(SPIExt& spi) : SpiMonitor(static_cast<SPIBase&>(spi))
+	{
+		spiExt = &spi;
+	}
+
+	bool begin() override
+	{
+		return spi.begin();
+	}
+
+	void end() override
+	{
+		spi.end();
+	}
+
+	using SPIExt::transfer;
+
+	uint32_t transfer32(uint32_t val, uint8_t bits = 32) override
+	{
+		stats.bytes += bits / 8;
+		return spi.transfer32(val, bits);
+	}
+
+	void transfer(uint8_t* buffer, size_t size) override
+	{
+		stats.bytes += size;
+		if(size >= 6 && size <= 7 && (buffer[0] & 0xc0) == 0x40 && (buffer[5] & 0x01)) {
+			++stats.commands;
+		}
+		spi.transfer(buffer, size);
+	}
+
+	void send(const void* data, size_t size) override
+	{
+		stats.bytes += size;
+		if(spiExt != nullptr) {
+			spiExt->send(data, size);
+			return;
+		}
+		uint8_t buffer[64];
+		auto src = static_cast<const uint8_t*>(data);
+		while(size != 0) {
+			auto n = std::min(size, sizeof(buffer));
+			memcpy(buffer, src, n);
+			spi.transfer(buffer, n);
+			src += n;
+			size -= n;
+		}
+	}
+
+	void receive(void* data, size_t size) override
+	{
+		stats.bytes += size;
+		if(spiExt != nullptr) {
+			spiExt->receive(data, size);
+			return;
+		}
+		memset(data, 0xff, size);
+		spi.transfer(static_cast<uint8_t*>(data), size);
+	}
+
+	bool loopback(bool enable) override
+	{
+		return spi.loopback(enable);
+	}
+
+	const Stats& getStats() const
+	{
+		return stats;
+	}
+
+	void resetStats()
+	{
+		stats = {};
+	}
+
+protected:
+	void prepare(SPISettings& settings) override
+	{
+		spi.beginTransaction(settings);
+	}
+
+private:
+	SPIBase& spi;
+	SPIExt* spiExt{nullptr};
+	Stats stats{};
+};
@@ -0,0 +1,133 @@
+#include <Storage/SD/Worker.h>
+#include <Storage/Disk/SectorBuffer.h>
+#include <SmingTest.h>
+#include "common.h"
+
+#if defined(ARCH_ESP32) || defined(ARCH_HOST)
+
+using namespace Storage::SD;
+
+class WorkerTest : public TestGroup
+{
+public:
+	WorkerTest()
+		: TestGroup(_F("Worker")), card("worker", getCardSpi()), worker(card),
+		  data(card.getSectorSize(), SECTOR_COUNT), readback(card.getSectorSize(), SECTOR_COUNT)
+	{
+		REQUIRE(Storage::registerDevice(&card));
+	}
+
+	void execute() override
+	{
+		REQUIRE(card.begin(PIN_CARD_CS));
+		REQUIRE(data && readback);
+		const auto sectorSize = card.getSectorSize();
+		const auto offset = (os_random() % (card.getSectorCount() - SECTOR_COUNT)) * sectorSize;
+
+		TEST_CASE("Requests fail when stopped")
+		{
+			REQUIRE(!worker.isRunning());
+			REQUIRE(!worker.read(offset, readback.get(), sectorSize));
+		}
+
+		REQUIRE(worker.start());
+
+		TEST_CASE("Concurrent producers")
+		{
+			os_get_random(data.get(), data.size());
+			SD_METRICS(auto merged = card.getMetrics().mergedRequests;)
+
+			// Threads take alternate sectors, so requests which arrive together are contiguous
+			auto run = [&](bool write) {
+				std::atomic<unsigned> failures{0};
+				std::thread threads[THREAD_COUNT];
+				for(unsigned t = 0; t < THREAD_COUNT; ++t) {
+					threads[t] = std::thread([&, t]() {
+						for(auto sector = t; sector < SECTOR_COUNT; sector += THREAD_COUNT) {
+							auto address = offset + sector * sectorSize;
+							bool ok = write ? worker.write(address, data.get() + sector * sectorSize, sectorSize)
+											: worker.read(address, readback.get() + sector * sectorSize, sectorSize);
+							failures += !ok;
+						}
+					});
+				}
+				for(auto& thread : threads) {
+					thread.join();
+				}
+				return failures.load();
+			};
+
+			REQUIRE_EQ(run(true), 0);
+			REQUIRE(worker.sync());
+			readback.clear();
+			REQUIRE_EQ(run(false), 0);
+			REQUIRE(data == readback);
+			SD_METRICS(Serial << "Merged " << card.getMetrics().mergedRequests - merged << " requests" << endl;)
+		}
+
+		TEST_CASE("Erase")
+		{
+			REQUIRE(worker.erase_range(offset, data.size()));
+			REQUIRE(worker.read(offset, readback.get(), readback.size()));
+			REQUIRE(!(data == readback));
+		}
+
+		worker.stop();
+		REQUIRE(!worker.isRunning());
+
+		TEST_CASE("Stream sessions")
+		{
+			// Read-ahead and session timeout are suspended as they run from the task queue
+			REQUIRE(card.setReadStream(true, READ_AHEAD_SECTORS));
+			card.setWriteStream(true);
+			REQUIRE(worker.start());
+			REQUIRE(!card.submitRead(offset, readback.get(), sectorSize, nullptr));
+
+			os_get_random(data.get(), data.size());
+			readback.clear();
+			unsigned failures{0};
+			std::thread producer([&]() {
+				for(unsigned sector = 0; sector < SECTOR_COUNT; ++sector) {
+					auto pos = sector * sectorSize;
+					failures += !worker.write(offset + pos, data.get() + pos, sectorSize);
+				}
+				for(unsigned sector = 0; sector < SECTOR_COUNT; ++sector) {
+					auto pos = sector * sectorSize;
+					failures += !worker.read(offset + pos, readback.get() + pos, sectorSize);
+				}
+			});
+			producer.join();
+			worker.stop();
+			REQUIRE_EQ(failures, 0);
+			REQUIRE(data == readback);
+
+			// Nothing is left for the task queue to read
+			SD_METRICS(auto bytesRead = card.getMetrics().bytesRead;)
+			System.queueCallback([this SD_METRICS(, bytesRead)]() {
+				SD_METRICS(REQUIRE_EQ(card.getMetrics().bytesRead, bytesRead);)
+				REQUIRE(card.setReadStream(false));
+				card.setWriteStream(false);
+				complete();
+			});
+			pending();
+		}
+	}
+
+private:
+	static constexpr unsigned THREAD_COUNT{4};
+	static constexpr unsigned SECTOR_COUNT{256};
+	static constexpr unsigned READ_AHEAD_SECTORS{8};
+	Card card;
+	Worker worker;
+	Storage::Disk::SectorBuffer data;
+	Storage::Disk::SectorBuffer readback;
+};
+
+#endif
+
+void REGISTER_TEST(worker)
+{
+#if defined(ARCH_ESP32) || defined(ARCH_HOST)
+	registerGroup<WorkerTest>();
+#endif
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#ifdef ARCH_HOST
+#include <Storage/SD/Emulator.h>
+#else
+#include <SPI.h>
+#endif
+
+// Chip selects independent of SPI controller in use
+#ifdef ARCH_ESP32
+#define PIN_CARD_CS 21
+#elif defined(ARCH_HOST)
+// Not used by emulator
+#define PIN_CARD_CS 0
+#else
+// Esp8266 cannot use GPIO15 as this affects boot mode
+#define PIN_CARD_CS 5
+#endif
+
+/**
+ * @brief Get the SPI interface the test card is attached to
+ *
+ * For Host, this is a 1GB SDHC card emulated using a sparse image file.
+ */
+#ifdef ARCH_HOST
+inline Storage::SD::Emulator& getCardSpi()
+{
+	static Storage::SD::Emulator emulator(F("out/sdcard.img"), 1024ULL * 1024 * 1024);
+	return emulator;
+}
+#else
+inline SPIClass& getCardSpi()
+{
+	return SPI;
+}
+#endif